@@ -25,10 +25,10 @@
 
 #if FANS_ENABLE
 
-#if FANS_ENABLE > 4
+#if FANS_ENABLE > 8
 #undef FANS_ENABLE
-#define FANS_ENABLE 4
-#warning Max number of allowed fans is 4!
+#define FANS_ENABLE 8
+#warning Max number of allowed fans is 8!
 #endif
 
 #include <string.h>
@@ -38,36 +38,594 @@
 #include "grbl/protocol.h"
 #include "grbl/nvs_buffer.h"
 #include "grbl/spindle_control.h"
+#include "grbl/planner.h"
+#include "grbl/motion_control.h"
+
+#include "fans.h"
+
+#if defined(MODBUS_ENABLE) && MODBUS_ENABLE
+#define FANS_MODBUS 1
+#include "spindle/modbus.h"
+#else
+#define FANS_MODBUS 0
+#endif
+
+// Setting ids, in addition to the core fan settings $386 - $389, $480 and $483 the plugin is allocated $900 - $999 and $1900 - $1999:
+//   $9<n><p>  - per fan settings, fan <n> 0 - 7 and fan_setting_param_t <p>. $900 - $979.
+//   $980-$999 - settings common to all fans, Setting_FanRpmLink to Setting_FanAirAssistLink.
+//   $19<n><p> - extended per fan settings, fan <n> 0 - 7 and fan_setting_ext_param_t <p>. $1900 - $1979.
+//   $1980-$1999 - extended settings common to all fans, from Setting_FanAirAssistHoldOff.
+// Port settings for fan 0 - 3 are $386 - $389, fan 4 - 7 uses FanSetting_Port.
+// Off delay setting for fan 0 is $480, fan 1 - 7 uses FanSetting_OffDelay.
+// Settings are listed in the settings tables in numeric order, per fan settings in parameter order.
+#define Setting_FanSettingsBase 900
+#define FAN_SETTING_ID(fan, param) ((setting_id_t)(Setting_FanSettingsBase + (fan) * 10 + (param)))
+#define FAN_PORT_SETTING_ID(fan) ((fan) < 4 ? (setting_id_t)(Setting_FanPort0 + (fan)) : FAN_SETTING_ID(fan, FanSetting_Port))
+#define FAN_OFF_DELAY_SETTING_ID(fan) ((fan) == 0 ? Setting_Fan0OffDelay : FAN_SETTING_ID(fan, FanSetting_OffDelay))
+
+#define Setting_FanSettingsExtBase 1900
+#define FAN_EXT_SETTING_ID(fan, param) ((setting_id_t)(Setting_FanSettingsExtBase + (fan) * 10 + (param)))
+
+typedef enum {
+    FanSetting_Port = 0,
+    FanSetting_PortType = 1,
+    FanSetting_DutyMin = 2,
+    FanSetting_DutyMax = 3,
+    FanSetting_OffDelay = 4,
+    FanSetting_MinOnTime = 5,
+    FanSetting_TachPort = 6,
+    FanSetting_TachPPR = 7,
+    FanSetting_StallRpm = 8,
+    FanSetting_StallGrace = 9
+} fan_setting_param_t;
+
+typedef enum {
+    FanSettingExt_Spindle = 0,
+    FanSettingExt_LinkSource = 1,
+    FanSettingExt_ModbusAddress = 2,
+    FanSettingExt_ModbusRegister = 3,
+    FanSettingExt_ModbusMax = 4
+} fan_setting_ext_param_t;
+
+// Link sources in addition to spindle enable, bit numbers in the per fan link source setting.
+typedef enum {
+    FanLink_Flood = 0,
+    FanLink_Mist,
+    FanLink_Program,
+    FanLink_N
+} fan_link_source_t;
+
+#define Setting_FanRpmLink           ((setting_id_t)(Setting_FanSettingsBase + 80))
+#define Setting_FanRpmMin            ((setting_id_t)(Setting_FanSettingsBase + 81))
+#define Setting_FanRpmMax            ((setting_id_t)(Setting_FanSettingsBase + 82))
+#define Setting_FanRpmBreakpoint     ((setting_id_t)(Setting_FanSettingsBase + 83))
+#define Setting_FanRpmBreakpointDuty ((setting_id_t)(Setting_FanSettingsBase + 84))
+#define Setting_FanRpmHysteresis     ((setting_id_t)(Setting_FanSettingsBase + 85))
+#define Setting_FanStallAction       ((setting_id_t)(Setting_FanSettingsBase + 86))
+#define Setting_FanTempLink          ((setting_id_t)(Setting_FanSettingsBase + 87))
+#define Setting_FanTempPort          ((setting_id_t)(Setting_FanSettingsBase + 88))
+#define Setting_FanTempSetpoint      ((setting_id_t)(Setting_FanSettingsBase + 89))
+#define Setting_FanTempKp            ((setting_id_t)(Setting_FanSettingsBase + 90))
+#define Setting_FanTempKi            ((setting_id_t)(Setting_FanSettingsBase + 91))
+#define Setting_FanTempKd            ((setting_id_t)(Setting_FanSettingsBase + 92))
+#define Setting_FanStartStagger      ((setting_id_t)(Setting_FanSettingsBase + 93))
+#define Setting_FanSoftStart         ((setting_id_t)(Setting_FanSettingsBase + 94))
+#define Setting_FanCompactReport     ((setting_id_t)(Setting_FanSettingsBase + 95))
+#define Setting_FanReportRate        ((setting_id_t)(Setting_FanSettingsBase + 96))
+#define Setting_FanPlannerSync       ((setting_id_t)(Setting_FanSettingsBase + 97))
+#define Setting_FanLeadTime          ((setting_id_t)(Setting_FanSettingsBase + 98))
+#define Setting_FanAirAssistLink     ((setting_id_t)(Setting_FanSettingsBase + 99))
+#define Setting_FanAirAssistHoldOff  ((setting_id_t)(Setting_FanSettingsExtBase + 80))
+#define Setting_FanStandbyLink       ((setting_id_t)(Setting_FanSettingsExtBase + 81))
+#define Setting_FanStandbyDelay      ((setting_id_t)(Setting_FanSettingsExtBase + 82))
+#define Setting_FanStandbyDuty       ((setting_id_t)(Setting_FanSettingsExtBase + 83))
+
+#if FANS_ENABLE == 1
+#define FOR_EACH_FAN(X) X(0)
+#define FANS_BITFIELD_FORMAT "Fan 0"
+#elif FANS_ENABLE == 2
+#define FOR_EACH_FAN(X) X(0) X(1)
+#define FANS_BITFIELD_FORMAT "Fan 0,Fan 1"
+#elif FANS_ENABLE == 3
+#define FOR_EACH_FAN(X) X(0) X(1) X(2)
+#define FANS_BITFIELD_FORMAT "Fan 0,Fan 1,Fan 2"
+#elif FANS_ENABLE == 4
+#define FOR_EACH_FAN(X) X(0) X(1) X(2) X(3)
+#define FANS_BITFIELD_FORMAT "Fan 0,Fan 1,Fan 2,Fan 3"
+#elif FANS_ENABLE == 5
+#define FOR_EACH_FAN(X) X(0) X(1) X(2) X(3) X(4)
+#define FANS_BITFIELD_FORMAT "Fan 0,Fan 1,Fan 2,Fan 3,Fan 4"
+#elif FANS_ENABLE == 6
+#define FOR_EACH_FAN(X) X(0) X(1) X(2) X(3) X(4) X(5)
+#define FANS_BITFIELD_FORMAT "Fan 0,Fan 1,Fan 2,Fan 3,Fan 4,Fan 5"
+#elif FANS_ENABLE == 7
+#define FOR_EACH_FAN(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6)
+#define FANS_BITFIELD_FORMAT "Fan 0,Fan 1,Fan 2,Fan 3,Fan 4,Fan 5,Fan 6"
+#else
+#define FOR_EACH_FAN(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)
+#define FANS_BITFIELD_FORMAT "Fan 0,Fan 1,Fan 2,Fan 3,Fan 4,Fan 5,Fan 6,Fan 7"
+#endif
+
+#define FANS_ALL ((1 << FANS_ENABLE) - 1)
+#define FAN_RPM_LUT_SIZE 17
+#define FAN_TICK_PERIOD 100 // ms, temperature control rate
+#define FAN_TACH_PERIOD 500 // ms, tachometer sample period, must be a multiple of FAN_TICK_PERIOD
+#define FAN_TEMP_LUT_SIZE 33
+
+// Thermistor connected between analog input and ground with a series resistor to the ADC reference.
+#ifndef FAN_THERMISTOR_BETA
+#define FAN_THERMISTOR_BETA 3950.0f
+#endif
+#ifndef FAN_THERMISTOR_R25
+#define FAN_THERMISTOR_R25 100000.0f    // Ohm at 25 degC
+#endif
+#ifndef FAN_THERMISTOR_SERIES_R
+#define FAN_THERMISTOR_SERIES_R 4700.0f // Ohm
+#endif
+#ifndef FAN_TEMP_ADC_BITS
+#define FAN_TEMP_ADC_BITS 12
+#endif
+
+#ifndef FAN_TEMP_DIGITAL_ON
+#define FAN_TEMP_DIGITAL_ON 64  // Controller output, 0 - 255, at which digital fans are turned on. They are turned off at 0
+#endif
+
+#define FAN_TEMP_MIN -400   // 0.1 degC, LUT limits
+#define FAN_TEMP_MAX 3000
+#define FAN_PID_SHIFT 12    // Fixed point fraction bits of PID gains and integrator
+#ifndef FAN_STATS_SAVE_INTERVAL
+#define FAN_STATS_SAVE_INTERVAL 30  // minutes of accumulated fan runtime before runtime statistics are written to NVS when idle
+#endif
+#define FAN_STATS_MIN_SAVE 60       // seconds of accumulated fan runtime before runtime statistics are written to NVS on program completion
+#ifndef FAN_SETTINGS_FLUSH_DELAY
+#define FAN_SETTINGS_FLUSH_DELAY 2000 // ms without changes before settings are written to NVS, 0 to write immediately
+#endif
+#define FAN_SETTINGS_VERSION 5
+#define FAN_SETTINGS_NVS_SIZE (64 + FANS_ENABLE * 32)
+#define FAN_SYNC_QUEUE_SIZE 8 // Max number of pending planner synchronized commands, must be a power of 2
+#define FAN_OVR_QUEUE_SIZE 8  // Max number of pending override commands, must be a power of 2
+
+// Realtime commands for fan duty overrides, add to my_machine.h to change.
+#ifndef CMD_OVERRIDE_FAN_RESET
+#define CMD_OVERRIDE_FAN_RESET          0xB1 // Restore override of selected fan(s) to 100%
+#endif
+#ifndef CMD_OVERRIDE_FAN_COARSE_PLUS
+#define CMD_OVERRIDE_FAN_COARSE_PLUS    0xB2
+#endif
+#ifndef CMD_OVERRIDE_FAN_COARSE_MINUS
+#define CMD_OVERRIDE_FAN_COARSE_MINUS   0xB3
+#endif
+#ifndef CMD_OVERRIDE_FAN_FINE_PLUS
+#define CMD_OVERRIDE_FAN_FINE_PLUS      0xB4
+#endif
+#ifndef CMD_OVERRIDE_FAN_FINE_MINUS
+#define CMD_OVERRIDE_FAN_FINE_MINUS     0xB5
+#endif
+#ifndef CMD_OVERRIDE_FAN_SELECT
+#define CMD_OVERRIDE_FAN_SELECT         0xB6 // Cycle override target between all fans and each analog fan
+#endif
+#define FAN_OVERRIDE_MIN 10     // percent
+#define FAN_OVERRIDE_MAX 200    // percent
+#define FAN_OVERRIDE_COARSE 10  // percent
+#define FAN_OVERRIDE_FINE 1     // percent
+#define FAN_REPORT_SIZE (4 + 4 + FANS_ENABLE * 8 + 1) // Compact report: "|FX:", temperature, per fan flags, duty and RPM, terminator
+
+typedef enum {
+    FanPort_Digital = 0,
+    FanPort_Analog,
+    FanPort_Modbus
+} fan_port_type_t;
+
+#if FANS_MODBUS
+#define FAN_PORT_TYPES "Digital,Analog (PWM),Modbus"
+#else
+#define FAN_PORT_TYPES "Digital,Analog (PWM)"
+#endif
+
+typedef struct {
+    uint16_t reg;       // Holding register to write speed to
+    uint16_t max_value; // Register value for full speed
+    uint8_t address;    // Slave address
+} fan_modbus_config_t;
+
+typedef enum {
+    FanStall_Warning = 0,
+    FanStall_FeedHold,
+    FanStall_Alarm
+} fan_stall_action_t;
 
 typedef struct {
-    uint8_t port[4];
-    uint8_t spindle_link;
-    float fan0_off_delay;
+    uint8_t port;
+    uint8_t port_type;  // fan_port_type_t
+    uint8_t duty_min;   // percent
+    uint8_t duty_max;   // percent
+    uint8_t tach_port;
+    uint8_t tach_ppr;   // tachometer pulses per revolution
+    uint8_t spindle;    // Spindle id for spindle link, 0xFF for any spindle
+    uint16_t min_on_time; // seconds
+    uint16_t stall_rpm; // 0 to disable stall detection
+    float stall_grace;  // seconds
+    float off_delay;    // minutes
+} fan_config_t;
+
+// Settings are stored in a fixed size NVS block with a version number. New settings must be added at the end
+// of the structure and FAN_SETTINGS_VERSION incremented, fan_settings_migrate() then sets their defaults
+// so that existing settings are kept. The spare space is stored as zeros.
+typedef union {
+    uint8_t reserve[FAN_SETTINGS_NVS_SIZE];
+    struct {
+        uint8_t version;
+        fan_config_t fan[FANS_ENABLE];
+        uint8_t spindle_link;
+        uint8_t rpm_link;
+        uint8_t rpm_breakpoint_duty; // percent
+        uint8_t stall_action; // fan_stall_action_t
+        uint8_t temp_link;
+        uint8_t temp_port;
+        uint8_t compact_report;
+        uint8_t report_rate;    // Hz, 0 for no limit
+        uint8_t planner_sync;
+        uint16_t start_stagger; // ms
+        uint16_t soft_start;    // ms
+        float lead_time;        // seconds
+        uint16_t rpm_hysteresis;
+        float rpm_min;
+        float rpm_max;
+        float rpm_breakpoint;
+        float temp_setpoint;    // degC
+        float temp_kp;          // percent per degC
+        float temp_ki;          // percent per degC * s
+        float temp_kd;          // percent per degC / s
+        // Version 2
+        uint8_t air_assist_link;
+        uint16_t air_assist_holdoff; // ms
+        // Version 3
+        uint8_t link_source[FANS_ENABLE]; // fan_link_source_t bits
+        // Version 4
+        uint8_t standby_link;
+        uint8_t standby_duty;   // percent, 0 to turn off
+        uint16_t standby_delay; // minutes, 0 to disable
+        // Version 5
+        fan_modbus_config_t modbus[FANS_ENABLE];
+    };
 } fan_settings_t;
 
+_Static_assert(sizeof(((fan_settings_t *)0)->reserve) == sizeof(fan_settings_t), "Fan settings does not fit in reserved NVS space");
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t on      :1,
+                linked  :1, // Turned on by the spindle
+                spindle :1, // Linked to spindle enable
+                rpm     :1, // Speed follows spindle RPM
+                analog  :1,
+                tach    :1, // Tachometer input claimed
+                stalled :1, // Stall action raised, cleared on recovery or turn off
+                temp    :1; // Speed controlled by temperature
+    };
+} fan_flags_t;
+
+typedef void (*fan_output_ptr)(uint_fast8_t idx);
+
+typedef struct {
+    uint8_t port;       // Claimed aux port or Modbus address, 0xFF if not available
+    uint8_t setting_port; // Aux port as numbered in settings, may differ from the claimed port. 0xFF if none
+    fan_flags_t flags;
+    fan_output_ptr output; // Output backend
+    uint8_t duty;       // Commanded duty, 0 - 255
+    uint8_t duty_min;   // 0 - 255
+    uint8_t duty_max;   // 0 - 255
+    uint8_t ramp;       // Soft start output duty, 0 when not ramping
+    uint8_t tach_port;  // Claimed aux input port, 0xFF if not available
+    uint16_t rpm;       // Measured speed, 0 if no tachometer
+    uint32_t tach_last; // Tachometer count at last sample
+    uint32_t stall_grace; // ms
+    uint32_t stall_at;  // Tick count when speed first dropped below stall RPM, 0 if running
+    uint32_t off_delay; // ms
+    uint32_t min_on;    // ms
+    uint32_t on_at;     // Tick count when turned on
+    uint32_t off_at;    // Tick count for delayed turn off, 0 if none pending
+    uint32_t start_at;  // Tick count for staggered turn on, 0 if none pending
+    uint16_t reported;  // State at last report, see fan_report_state()
+    uint32_t run_ms;    // Runtime not yet accounted for in stats, ms
+    uint32_t energy_acc; // Duty * ms not yet accounted for in stats
+    uint8_t override;   // Duty override, percent
+    uint8_t standby;    // Commanded duty before standby, 0 if turned off by standby
+    uint16_t notified;  // State at last on_fan_changed event, see fan_report_state()
+} fan_t;
+
+// Spindle RPM to fan speed curve, values in the lookup table are 0 - 255 for
+// spindle RPM from rpm_min to rpm_min + (FAN_RPM_LUT_SIZE - 1) * step.
+typedef struct {
+    uint32_t rpm_min;
+    uint32_t step;      // RPM per table interval, 0 if curve is disabled.
+    uint32_t rpm_last[N_SPINDLE]; // RPM at last update per spindle, for hysteresis.
+    uint8_t lut[FAN_RPM_LUT_SIZE];
+} fan_rpm_curve_t;
+
+// Runtime statistics, stored in a separate NVS block.
+typedef struct {
+    uint32_t runtime[FANS_ENABLE];  // seconds
+    uint32_t energy[FANS_ENABLE];   // seconds at full duty
+} fan_stats_t;
+
+// M106/M107 command pending until the planner blocks queued before it has been completed.
+typedef struct {
+    uint8_t mask;       // Fans to apply the command to
+    uint8_t duty;       // 0 to turn off
+    uint16_t ahead;     // Number of planner blocks to complete before the command is applied
+} fan_sync_cmd_t;
+
+typedef struct {
+    uint_fast8_t head;
+    uint_fast8_t tail;
+    plan_block_t *block; // Current planner block at last poll
+    fan_sync_cmd_t cmd[FAN_SYNC_QUEUE_SIZE];
+} fan_sync_queue_t;
+
+// Fixed point PID controller for temperature controlled fans, temperatures are in 0.1 degC.
+// Output level is 0 - 255, mapped to the min to max duty range of each fan.
+typedef struct {
+    uint8_t port;       // Claimed analog input port, 0xFF if not available
+    int16_t temp;       // Last reading
+    int16_t setpoint;
+    int32_t kp, ki, kd; // Gains, FAN_PID_SHIFT fraction bits, per control period
+    int32_t integ;      // Integrator, FAN_PID_SHIFT fraction bits
+    int16_t lut[FAN_TEMP_LUT_SIZE]; // Temperature for ADC readings 0 - full scale
+} fan_temp_ctrl_t;
+
+#define FAN_NAME(n) "Fan " #n,
+
 static const char *fan_names[] = {
-    "Fan 0",
-    "Fan 1",
-    "Fan 2",
-    "Fan 3"
+    FOR_EACH_FAN(FAN_NAME)
+};
+
+#define FAN_TACH_NAME(n) "Fan " #n " tach",
+
+static const char *fan_tach_names[] = {
+    FOR_EACH_FAN(FAN_TACH_NAME)
+};
+
+#define FAN_STALL_MSG(n) "Fan " #n " stalled!",
+
+static const char *fan_stall_msg[] = {
+    FOR_EACH_FAN(FAN_STALL_MSG)
+};
+
+// Tachometer pulse counters, only written by the interrupt handlers below.
+static volatile uint32_t tach_count[FANS_ENABLE] = {0};
+
+#define FAN_TACH_ISR(n) static void fan_tach_isr_##n (uint8_t port, bool state) { tach_count[n]++; }
+
+FOR_EACH_FAN(FAN_TACH_ISR)
+
+#define FAN_TACH_ISR_PTR(n) fan_tach_isr_##n,
+
+static const ioport_interrupt_callback_ptr fan_tach_isr[] = {
+    FOR_EACH_FAN(FAN_TACH_ISR_PTR)
 };
 
-static uint32_t n_fans = 0, fans_on = 0, fans_linked = 0;
+static uint32_t n_fans = 0;
+static fan_t fans[FANS_ENABLE];
+static fan_rpm_curve_t rpm_curve = {0};
+static fan_temp_ctrl_t temp_ctrl = { .port = 0xFF };
+static fan_sync_queue_t sync_queue = {0};
+static struct {
+    uint32_t mask;
+    uint8_t duty;
+} mcode_cmd; // M106/M107 parameters, set by validation as the parameter words are consumed
+static uint_fast8_t tick_count = 0;
+static uint_fast8_t ramp_step = 0; // Soft start duty increment per tick, 0 if disabled
+static uint32_t fans_dirty = 0;    // Fans with state changed since last report
+static uint32_t report_at = 0;     // Tick count of last report with fan state
+static uint32_t air_fans = 0;      // Air assist fans, only set in laser mode
+static volatile bool laser_firing = false; // Laser is on with non-zero power, set from the spindle callbacks
+static bool air_firing = false;    // Laser firing state last acted on by the air assist fans
+static spindle_update_pwm_ptr on_spindle_update_pwm[N_SPINDLE] = {0};
+static on_unknown_realtime_cmd_ptr on_unknown_realtime_cmd;
+static uint8_t ovr_cmd[FAN_OVR_QUEUE_SIZE]; // Override commands queued by the realtime command handler
+static volatile uint_fast8_t ovr_head = 0;
+static uint_fast8_t ovr_tail = 0;
+static uint8_t ovr_fan = 0xFF;     // Fan selected for overrides, 0xFF for all
+static bool ovr_changed = false;   // Overrides changed since last report
+static uint_fast16_t spindle_pwm_off[N_SPINDLE] = {0};
+static bool report_pending = false;
+static uint32_t timer_due = 0; // Tick count the shared fan timer is armed for, 0 if not armed.
+static uint32_t tach_sampled_at; // Tick count of last tachometer sample.
 static user_mcode_ptrs_t user_mcode;
 static on_spindle_select_ptr on_spindle_select;
+static on_spindle_programmed_ptr on_spindle_programmed;
 static on_report_options_ptr on_report_options;
 static on_realtime_report_ptr on_realtime_report;
 static on_program_completed_ptr on_program_completed;
-static spindle_set_state_ptr on_spindle_set_state, fan_spindle_set_state = NULL;
+static on_execute_realtime_ptr on_execute_realtime;
+static on_state_change_ptr on_state_change;
+static coolant_set_state_ptr coolant_set_state;
+static coolant_state_t coolant_state = {0};
+static bool program_running = false;
+static uint32_t link_fans[FanLink_N] = {0}; // Linked fans for each link source
+static uint32_t standby_at = 0;     // Tick count for entering standby, 0 if not pending
+static uint32_t standby_mask = 0;   // Fans in standby
+static uint32_t standby_linked = 0; // Link source owned fans turned off by standby
+static uint8_t standby_duty = 0;    // 0 - 255
+static fans_events_t fan_events = {0};
+#if FANS_MODBUS
+static uint32_t modbus_dirty = 0;   // Modbus fans with speed changes not yet sent
+static uint32_t modbus_busy = 0;    // Modbus fans with a command in flight
+static void fans_modbus_flush (void *data);
+#endif
+static fans_digital_out_mask_ptr digital_out_mask = NULL;
+static spindle_set_state_ptr on_spindle_set_state[N_SPINDLE] = {0};
 static on_unknown_accessory_override_ptr on_unknown_accessory_override;
 static driver_reset_ptr driver_reset;
-static fan_settings_t fan_setting, fans;
-static uint8_t n_ports;
-static char max_port[4] = "0";
-static nvs_address_t nvs_address;
+static fan_settings_t fan_setting;
+static spindle_state_t spindle_state[N_SPINDLE] = {0};
+static uint8_t spindle_fans[N_SPINDLE] = {0}; // Linked fans for each spindle id
+static char max_spindle[4] = "0";
+static uint8_t n_ports, n_aports, n_iports, n_aiports;
+static uint8_t n_free[2] = {0};     // Number of free digital and analog output ports at startup
+static uint32_t port_map[2] = {0};  // Free digital and analog output ports at startup, ports 32 and above are assumed free
+static uint32_t port_released[2] = {0}; // Digital and analog output ports, as numbered in settings, claimed by the plugin that are no longer assigned to a fan
+static uint8_t port_released_claimed[2][32]; // Claimed port numbers for released ports
+static bool ports_loaded = false;
+static char max_port[4] = "0", max_iport[4] = "0", max_aiport[4] = "0";
+static nvs_address_t nvs_address, nvs_stats = 0;
+static void fan_settings_flush (void *data);
+static void fan_settings_write (void);
+static bool settings_dirty = false;
+static fan_stats_t fan_stats;
+static uint32_t stats_at = 0;       // Tick count of last stats update
+static uint32_t stats_unsaved = 0;  // Seconds of runtime accounted for since stats was last written to NVS
+
+// Optional execution time profiling of the callbacks in the spindle, realtime report and timer paths,
+// add #define FANS_PROFILE 1 to my_machine.h to enable. Results are reported by the $FANSTAT command.
+// Cycles are counted by the DWT cycle counter if available, else microseconds by hal.get_micros().
+#ifndef FANS_PROFILE
+#define FANS_PROFILE 0
+#endif
+
+#if FANS_PROFILE
+
+typedef enum {
+    FanProfile_SpindleSetState = 0,
+    FanProfile_SetMask,
+    FanProfile_RealtimeReport,
+    FanProfile_Timer,
+    FanProfile_N
+} fan_profile_id_t;
+
+typedef struct {
+    uint32_t min;
+    uint32_t max;
+    uint32_t count;
+    uint64_t total;
+} fan_profile_t;
+
+#ifndef FAN_PROFILE_TIMER
+#ifdef DWT
+#define FAN_PROFILE_TIMER() (DWT->CYCCNT)
+#define FAN_PROFILE_UNIT "cycles"
+#else
+#define FAN_PROFILE_TIMER() (hal.get_micros ? hal.get_micros() : 0)
+#define FAN_PROFILE_UNIT "us"
+#endif
+#endif
+#ifndef FAN_PROFILE_UNIT
+#define FAN_PROFILE_UNIT "ticks"
+#endif
 
-bool fan_get_state (uint8_t fan);
-void fan_set_state (uint8_t fan, bool on);
+#define FAN_PROFILE_START() uint32_t profile_start = FAN_PROFILE_TIMER()
+#define FAN_PROFILE_END(id) fan_profile_record(id, FAN_PROFILE_TIMER() - profile_start)
+
+static fan_profile_t fan_profile[FanProfile_N];
+static const char *const fan_profile_name[FanProfile_N] = { "SpindleSetState", "SetMask", "RealtimeReport", "Timer" };
+
+static void fan_profile_record (fan_profile_id_t id, uint32_t elapsed)
+{
+    fan_profile_t *profile = &fan_profile[id];
+
+    if(profile->count == 0 || elapsed < profile->min)
+        profile->min = elapsed;
+    if(elapsed > profile->max)
+        profile->max = elapsed;
+    profile->total += elapsed;
+    profile->count++;
+}
+
+#else
+#define FAN_PROFILE_START()
+#define FAN_PROFILE_END(id)
+#endif
+
+static void fan_update_duty (uint_fast8_t fan, uint8_t duty);
+static void fan_output (uint_fast8_t idx);
+static inline uint_fast8_t fan_duty_out (fan_t *fan);
+static void fans_override_reset (uint32_t mask);
+static void fans_override_poll (void);
+
+// Returns bitmask of available fans that has any of the given flags set.
+static uint32_t fans_get_mask (fan_flags_t flags)
+{
+    uint32_t mask = 0;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    do {
+        if(fans[--idx].port != 0xFF && (fans[idx].flags.value & flags.value))
+            bit_true(mask, bit(idx));
+    } while(idx);
+
+    return mask;
+}
+
+// Reportable state of fan: on/off, stall status and output duty for analog fans.
+static inline uint16_t fan_report_state (fan_t *fan)
+{
+    return fan->flags.on | (fan->flags.stalled << 1) | (fan->flags.analog && fan->flags.on ? fan_duty_out(fan) << 8 : 0);
+}
+
+static void fans_report_request (void);
+
+static void fans_report_timeout (void *data)
+{
+    report_pending = false;
+    fans_report_request();
+}
+
+// Raise report flag if any fan is dirty, delayed if the configured report rate would be exceeded.
+static void fans_report_request (void)
+{
+    if(fans_dirty && !report_pending) {
+
+        uint32_t interval = fan_setting.report_rate ? 1000 / fan_setting.report_rate : 0, since = hal.get_elapsed_ticks() - report_at;
+
+        if(since >= interval)
+            sys.report.fan = On;
+        else
+            report_pending = task_add_delayed(fans_report_timeout, NULL, interval - since);
+    }
+}
+
+// Update dirty bitmap for fans in mask against the last reported state.
+static void fans_report_check (uint32_t mask)
+{
+    uint32_t changed = 0;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    do {
+        fan_t *fan = &fans[--idx];
+        if(mask & bit(idx)) {
+            uint16_t state = fan_report_state(fan);
+            if(state != fan->reported)
+                bit_true(fans_dirty, bit(idx));
+            else
+                bit_false(fans_dirty, bit(idx));
+            if(state != fan->notified) {
+                fan->notified = state;
+                bit_true(changed, bit(idx));
+            }
+        }
+    } while(idx);
+
+    fans_report_request();
+
+    if(changed && fan_events.on_fan_changed)
+        fan_events.on_fan_changed(changed);
+}
+
+// Returns bitmask of available fans.
+static uint32_t fans_available (void)
+{
+    uint32_t mask = 0;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    do {
+        if(fans[--idx].port != 0xFF)
+            bit_true(mask, bit(idx));
+    } while(idx);
+
+    return mask;
+}
 
 static user_mcode_type_t userMCodeCheck (user_mcode_t mcode)
 {
@@ -84,10 +642,28 @@ static status_code_t userMCodeValidate (parser_block_t *gc_block)
 
         case Fan_On:    // M106
         case Fan_Off:   // M107
-            if(gc_block->words.p) {
-                if(!isintf(gc_block->values.p) || gc_block->values.p < 0.0f  || fans.port[(uint_fast8_t)gc_block->values.p] == 0xFF)
+            mcode_cmd.mask = bit(0);
+            mcode_cmd.duty = gc_block->user_mcode == Fan_On ? 255 : 0;
+            if(gc_block->words.p && gc_block->words.q)
+                state = Status_GcodeValueOutOfRange; // P and Q are mutually exclusive
+            else if(gc_block->words.p) {
+                if(!isintf(gc_block->values.p) || gc_block->values.p < 0.0f || gc_block->values.p >= (float)FANS_ENABLE || fans[(uint_fast8_t)gc_block->values.p].port == 0xFF)
+                    state = Status_GcodeValueOutOfRange;
+                else
+                    mcode_cmd.mask = bit((uint32_t)gc_block->values.p);
+            } else if(gc_block->words.q) {
+                if(!isintf(gc_block->values.q) || gc_block->values.q < 1.0f || gc_block->values.q > (float)FANS_ALL || ((uint32_t)gc_block->values.q & ~fans_available()))
+                    state = Status_GcodeValueOutOfRange;
+                else
+                    mcode_cmd.mask = (uint32_t)gc_block->values.q;
+            }
+            gc_block->words.p = gc_block->words.q = Off;
+            if(gc_block->words.s) {
+                if(gc_block->user_mcode == Fan_Off || !isintf(gc_block->values.s) || gc_block->values.s < 0.0f || gc_block->values.s > 255.0f)
                     state = Status_GcodeValueOutOfRange;
-                gc_block->words.p = Off;
+                else
+                    mcode_cmd.duty = (uint8_t)gc_block->values.s;
+                gc_block->words.s = Off;
             }
             break;
 
@@ -96,392 +672,2188 @@ static status_code_t userMCodeValidate (parser_block_t *gc_block)
             break;
     }
 
-    return state == Status_Unhandled && user_mcode.validate ? user_mcode.validate(gc_block) : state;
+    return state == Status_Unhandled && user_mcode.validate ? user_mcode.validate(gc_block) : state;
+}
+
+static void fan_timer (void *data);
+static void fans_standby_enter (void);
+
+static void fan_timer_arm (uint32_t due)
+{
+    if(timer_due)
+        task_delete(fan_timer, NULL);
+
+    int32_t delay = (int32_t)(due - hal.get_elapsed_ticks());
+
+    timer_due = task_add_delayed(fan_timer, NULL, delay > 0 ? (uint32_t)delay : 1) ? due : 0;
+}
+
+// Clears and returns true if deadline has expired, else updates next with the earliest pending deadline.
+static inline bool fan_deadline_expired (uint32_t *at, uint32_t now, uint32_t *next)
+{
+    if(*at) {
+        if((int32_t)(*at - now) <= 0) {
+            *at = 0;
+            return true;
+        } else if(*next == 0 || (int32_t)(*at - *next) < 0)
+            *next = *at;
+    }
+
+    return false;
+}
+
+// Shared timer for all fans, turns fans with expired deadlines off or on and rearms for the earliest remaining one.
+static void fan_timer (void *data)
+{
+    FAN_PROFILE_START();
+
+    uint32_t now = hal.get_elapsed_ticks(), mask = 0, start = 0, next = 0;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    timer_due = 0;
+
+    do {
+        fan_t *fan = &fans[--idx];
+        if(fan_deadline_expired(&fan->off_at, now, &next))
+            bit_true(mask, bit(idx));
+        if(fan_deadline_expired(&fan->start_at, now, &next))
+            bit_true(start, bit(idx));
+    } while(idx);
+
+    if(mask)
+        fans_set_mask(mask, 0);
+
+    if(start)
+        fans_set_mask(start, start);
+
+    if(fan_deadline_expired(&standby_at, now, &next))
+        fans_standby_enter();
+
+    if(next)
+        fan_timer_arm(next);
+
+    FAN_PROFILE_END(FanProfile_Timer);
+}
+
+// Set deadline for fan, the shared timer is only rearmed if the deadline is earlier than the current one.
+static void fan_deadline_set (uint32_t *at, uint32_t delay)
+{
+    uint32_t due = hal.get_elapsed_ticks() + delay;
+
+    if(due == 0)
+        due = 1;
+
+    *at = due;
+
+    if(timer_due == 0 || (int32_t)(due - timer_due) < 0)
+        fan_timer_arm(due);
+}
+
+// Turn off running fans in mask after their off delay, but not before their minimum on time has elapsed.
+// Temperature controlled fans are left to the controller, pending staggered starts are cancelled.
+static void fans_off_delayed (uint32_t mask)
+{
+    uint32_t now = hal.get_elapsed_ticks(), off = 0;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    do {
+        fan_t *fan = &fans[--idx];
+        if((mask & bit(idx)) && fan->start_at) {
+            fan->start_at = 0;
+            fan->flags.linked = Off;
+        } else if((mask & bit(idx)) && fan->flags.on && !fan->flags.temp) {
+
+            uint32_t delay = fan->off_delay, on_for = now - fan->on_at;
+
+            if(on_for < fan->min_on && fan->min_on - on_for > delay)
+                delay = fan->min_on - on_for;
+
+            if(delay)
+                fan_deadline_set(&fan->off_at, delay);
+            else
+                bit_true(off, bit(idx));
+        }
+    } while(idx);
+
+    if(off)
+        fans_set_mask(off, 0);
+}
+
+static void fan_stalled (uint_fast8_t idx)
+{
+    protocol_enqueue_foreground_task(report_warning, (void *)fan_stall_msg[idx]);
+
+    switch((fan_stall_action_t)fan_setting.stall_action) {
+
+        case FanStall_FeedHold:
+            system_set_exec_state_flag(EXEC_FEED_HOLD);
+            break;
+
+        // Stop motion via the same path as the core uses for motor faults.
+        case FanStall_Alarm:
+            mc_reset();
+            system_set_exec_alarm(Alarm_MotorFault);
+            break;
+
+        default:
+            break;
+    }
+}
+
+// Turn on fans in mask, one at a time with the configured stagger interval between starts of fans not already running.
+// Starts are placed after the last start scheduled by earlier calls so fans started by different sources are staggered too.
+static void fans_on_staggered (uint32_t mask)
+{
+    static uint32_t start_slot = 0; // Tick count from which the next start can be made
+
+    uint32_t now = 0, ticks = hal.get_elapsed_ticks(), delay = (int32_t)(start_slot - ticks) > 0 ? start_slot - ticks : 0;
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < FANS_ENABLE; idx++) {
+        fan_t *fan = &fans[idx];
+        if((mask & bit(idx)) && fan->port != 0xFF) {
+            if(fan->flags.on)
+                bit_true(now, bit(idx));
+            else if(fan->start_at == 0) {
+                if(delay == 0)
+                    bit_true(now, bit(idx));
+                else
+                    fan_deadline_set(&fan->start_at, delay);
+                delay += fan_setting.start_stagger;
+                start_slot = ticks + delay;
+            }
+        }
+    }
+
+    if(now)
+        fans_set_mask(now, now);
+}
+
+// Periodic task, converts tachometer pulse counts to RPM and checks running fans for stall.
+// A stall is detected when the speed measured over a full sample period has stayed below the stall RPM
+// for the grace period, worst case detection time is grace + 2 * FAN_TACH_PERIOD after the fan stops.
+// The grace period also applies from turn on to allow for spin up.
+static void fan_tach_sample (void)
+{
+    uint32_t now = hal.get_elapsed_ticks(), elapsed = now - tach_sampled_at, window_start = tach_sampled_at;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    tach_sampled_at = now;
+
+    if(elapsed) do {
+        fan_t *fan = &fans[--idx];
+        if(fan->flags.tach) {
+
+            uint32_t count = tach_count[idx], rpm = (count - fan->tach_last) * 60000 / (elapsed * fan_setting.fan[idx].tach_ppr);
+
+            fan->tach_last = count;
+            fan->rpm = rpm > UINT16_MAX ? UINT16_MAX : (uint16_t)rpm;
+
+            if(fan->flags.on && fan->rpm < fan_setting.fan[idx].stall_rpm) {
+                if(fan->stall_at == 0)
+                    fan->stall_at = (int32_t)(fan->on_at - window_start) > 0 ? fan->on_at : window_start;
+                if(!fan->flags.stalled && now - fan->stall_at >= fan->stall_grace) {
+                    fan->flags.stalled = On;
+                    fan_stalled(idx);
+                    fans_report_check(bit(idx));
+                }
+            } else {
+                fan->stall_at = 0;
+                if(fan->flags.stalled) {
+                    fan->flags.stalled = Off;
+                    fans_report_check(bit(idx));
+                }
+            }
+        }
+    } while(idx);
+}
+
+// Build thermistor ADC reading to temperature table, called on startup only.
+static void fan_temp_lut_build (void)
+{
+    uint_fast8_t idx;
+    const float adc_max = (float)(1 << FAN_TEMP_ADC_BITS);
+
+    for(idx = 0; idx < FAN_TEMP_LUT_SIZE; idx++) {
+
+        float adc = (float)idx * adc_max / (float)(FAN_TEMP_LUT_SIZE - 1), temp;
+
+        if(adc <= 0.0f)
+            temp = (float)FAN_TEMP_MAX;
+        else if(adc >= adc_max)
+            temp = (float)FAN_TEMP_MIN;
+        else {
+            float r = FAN_THERMISTOR_SERIES_R * adc / (adc_max - adc);
+            temp = (1.0f / (1.0f / 298.15f + logf(r / FAN_THERMISTOR_R25) / FAN_THERMISTOR_BETA) - 273.15f) * 10.0f;
+        }
+
+        temp_ctrl.lut[idx] = temp > (float)FAN_TEMP_MAX ? FAN_TEMP_MAX : (temp < (float)FAN_TEMP_MIN ? FAN_TEMP_MIN : (int16_t)lroundf(temp));
+    }
+}
+
+// Returns temperature in 0.1 degC for ADC reading, linear interpolation between table entries.
+static int16_t fan_temp_from_adc (uint32_t adc)
+{
+    const uint32_t step = (1 << FAN_TEMP_ADC_BITS) / (FAN_TEMP_LUT_SIZE - 1);
+    uint32_t idx = adc / step;
+
+    if(idx >= FAN_TEMP_LUT_SIZE - 1)
+        return temp_ctrl.lut[FAN_TEMP_LUT_SIZE - 1];
+
+    return temp_ctrl.lut[idx] + ((int32_t)temp_ctrl.lut[idx + 1] - (int32_t)temp_ctrl.lut[idx]) * (int32_t)(adc - idx * step) / (int32_t)step;
+}
+
+// Temperature control, run once per FAN_TICK_PERIOD. Derivative is on measurement to avoid kicks on setpoint changes.
+static void fan_temp_control (void)
+{
+    int32_t adc = hal.port.wait_on_input(Port_Analog, temp_ctrl.port, WaitMode_Immediate, 0.0f), level;
+    int16_t temp, last = temp_ctrl.temp;
+
+    if(adc <= 0 || adc >= (1 << FAN_TEMP_ADC_BITS) - 1) {
+        level = 255; // Shorted or open sensor, run at full speed
+        temp_ctrl.temp = temp = FAN_TEMP_MAX;
+    } else {
+
+        int32_t error = (int32_t)(temp = fan_temp_from_adc((uint32_t)adc)) - temp_ctrl.setpoint;
+
+        temp_ctrl.temp = temp;
+        temp_ctrl.integ += temp_ctrl.ki * error;
+
+        // Anti windup
+        if(temp_ctrl.integ < 0)
+            temp_ctrl.integ = 0;
+        else if(temp_ctrl.integ > (255 << FAN_PID_SHIFT))
+            temp_ctrl.integ = 255 << FAN_PID_SHIFT;
+
+        level = (temp_ctrl.kp * error + temp_ctrl.integ + temp_ctrl.kd * (temp - last)) >> FAN_PID_SHIFT;
+        level = level < 0 ? 0 : (level > 255 ? 255 : level);
+    }
+
+    uint_fast8_t idx = FANS_ENABLE;
+    uint32_t now = hal.get_elapsed_ticks();
+
+    // Digital fans are switched with hysteresis and kept on for their minimum on time to avoid toggling on every update.
+    do {
+        fan_t *fan = &fans[--idx];
+        if(fan->flags.temp && fan->flags.analog)
+            fan_set_duty(idx, level == 0 ? 0 : fan->duty_min + (fan->duty_max > fan->duty_min ? (fan->duty_max - fan->duty_min) * level / 255 : 0));
+        else if(fan->flags.temp && (fan->flags.on ? level == 0 && now - fan->on_at >= fan->min_on : level >= FAN_TEMP_DIGITAL_ON))
+            fan_set_duty(idx, fan->flags.on ? 0 : 255);
+    } while(idx);
+}
+
+static void fan_stats_save (void)
+{
+    if(nvs_stats && stats_unsaved) {
+        hal.nvs.memcpy_to_nvs(nvs_stats, (uint8_t *)&fan_stats, sizeof(fan_stats_t), true);
+        stats_unsaved = 0;
+    }
+}
+
+// Accumulate runtime and duty weighted runtime of running fans, integer math only.
+// Statistics are written to NVS when idle after FAN_STATS_SAVE_INTERVAL minutes of accumulated runtime.
+static void fan_stats_update (void)
+{
+    uint32_t now = hal.get_elapsed_ticks(), elapsed = now - stats_at;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    stats_at = now;
+
+    do {
+        fan_t *fan = &fans[--idx];
+        if(fan->flags.on) {
+
+            fan->run_ms += elapsed;
+            fan->energy_acc += (fan->flags.analog ? (fan->ramp ? fan->ramp : fan_duty_out(fan)) : 255) * elapsed;
+
+            if(fan->run_ms >= 1000) {
+                fan_stats.runtime[idx] += fan->run_ms / 1000;
+                stats_unsaved += fan->run_ms / 1000;
+                fan->run_ms %= 1000;
+            }
+
+            if(fan->energy_acc >= 255 * 1000) {
+                fan_stats.energy[idx] += fan->energy_acc / (255 * 1000);
+                fan->energy_acc %= 255 * 1000;
+            }
+        }
+    } while(idx);
+
+    if(stats_unsaved >= FAN_STATS_SAVE_INTERVAL * 60 && state_get() == STATE_IDLE)
+        fan_stats_save();
+}
+
+// Periodic task for tachometer sampling, temperature control and runtime statistics.
+static void fan_tick (void *data)
+{
+    if(temp_ctrl.port != 0xFF)
+        fan_temp_control();
+
+#if FANS_MODBUS
+    if(modbus_dirty & ~modbus_busy)
+        fans_modbus_flush(NULL);
+#endif
+
+    if(ramp_step) {
+        uint_fast8_t idx = FANS_ENABLE;
+        do {
+            fan_t *fan = &fans[--idx];
+            if(fan->ramp) {
+                fan->ramp = fan->ramp + ramp_step >= fan_duty_out(fan) ? 0 : fan->ramp + ramp_step;
+                fan_output(idx);
+            }
+        } while(idx);
+    }
+
+    if(++tick_count == FAN_TACH_PERIOD / FAN_TICK_PERIOD) {
+        tick_count = 0;
+        fan_tach_sample();
+        fan_stats_update();
+    }
+
+    task_add_delayed(fan_tick, NULL, FAN_TICK_PERIOD);
+}
+
+// Apply pending planner synchronized commands when the planner blocks queued ahead of them have been completed.
+// Completed blocks are counted by following the block links from the block that was current at the last poll.
+static void fans_sync_poll (void)
+{
+    plan_block_t *block = plan_get_current_block();
+    uint_fast16_t done = 0;
+
+    if(block == NULL)
+        done = UINT16_MAX; // Planner is empty, apply all
+    else if(block != sync_queue.block) {
+        plan_block_t *prev = sync_queue.block;
+        while(prev != block && done < settings.planner_buffer_blocks) {
+            prev = prev->next;
+            done++;
+        }
+    }
+
+    sync_queue.block = block;
+
+    if(done) {
+
+        uint_fast8_t idx = sync_queue.tail;
+
+        while(idx != sync_queue.head) {
+            fan_sync_cmd_t *cmd = &sync_queue.cmd[idx];
+            if(cmd->ahead <= done) {
+                fans_set_duty(cmd->mask, cmd->duty);
+                sync_queue.tail = (sync_queue.tail + 1) & (FAN_SYNC_QUEUE_SIZE - 1);
+            } else
+                cmd->ahead -= done;
+            idx = (idx + 1) & (FAN_SYNC_QUEUE_SIZE - 1);
+        }
+    }
+}
+
+// Queue command to be applied when the stepper starts executing the next motion block, applied immediately if the planner is empty.
+static void fans_set_duty_synced (uint32_t mask, uint8_t duty)
+{
+    uint_fast8_t next = (sync_queue.head + 1) & (FAN_SYNC_QUEUE_SIZE - 1);
+
+    if(next == sync_queue.tail) {
+        protocol_buffer_synchronize(); // Queue is full, wait for the planner to drain.
+        fans_sync_poll();
+    }
+
+    if(sync_queue.head == sync_queue.tail)
+        sync_queue.block = plan_get_current_block();
+    else
+        fans_sync_poll();
+
+    if(sync_queue.block == NULL && sync_queue.head == sync_queue.tail)
+        fans_set_duty(mask, duty);
+    else {
+        sync_queue.cmd[sync_queue.head].mask = mask;
+        sync_queue.cmd[sync_queue.head].duty = duty;
+        sync_queue.cmd[sync_queue.head].ahead = settings.planner_buffer_blocks - 1 - plan_get_block_buffer_available();
+        sync_queue.head = (sync_queue.head + 1) & (FAN_SYNC_QUEUE_SIZE - 1);
+    }
+}
+
+// Air assist fans follows the laser firing state, they are turned on as soon as the laser fires
+// and off when the laser has been off for the hold-off time, avoids chatter between short vectors.
+static void fans_air_assist_poll (void)
+{
+    uint_fast8_t idx = FANS_ENABLE;
+
+    if((air_firing = laser_firing))
+        fans_set_mask(air_fans, air_fans); // Cancels pending turn off
+    else do {
+        if((air_fans & bit(--idx)) && fans[idx].flags.on)
+            fan_deadline_set(&fans[idx].off_at, fan_setting.air_assist_holdoff);
+    } while(idx);
+}
+
+static void onExecuteRealtime (sys_state_t state)
+{
+    if(sync_queue.head != sync_queue.tail)
+        fans_sync_poll();
+
+    if(air_firing != laser_firing)
+        fans_air_assist_poll();
+
+    if(ovr_tail != ovr_head)
+        fans_override_poll();
+
+    on_execute_realtime(state);
+}
+
+static void userMCodeExecute (uint_fast16_t state, parser_block_t *gc_block)
+{
+    bool handled = true;
+
+    if (state != STATE_CHECK_MODE)
+      switch(gc_block->user_mcode) {
+
+        case Fan_On:
+        case Fan_Off:
+            if(fan_setting.planner_sync)
+                fans_set_duty_synced(mcode_cmd.mask, mcode_cmd.duty);
+            else
+                fans_set_duty(mcode_cmd.mask, mcode_cmd.duty);
+            break;
+
+        default:
+            handled = false;
+            break;
+    }
+
+    if(!handled && user_mcode.execute)
+        user_mcode.execute(state, gc_block);
+}
+
+static void driverReset (void)
+{
+    driver_reset();
+
+    sync_queue.head = sync_queue.tail = 0;
+    laser_firing = air_firing = false;
+    standby_at = standby_mask = standby_linked = 0;
+    ovr_tail = ovr_head;
+    fans_override_reset(FANS_ALL);
+
+    if(timer_due) {
+        task_delete(fan_timer, NULL);
+        timer_due = 0;
+    }
+
+    fans_set_mask(FANS_ALL, 0);
+}
+
+// Rebuild spindle RPM to fan speed lookup table, called on settings changes only.
+static void fan_rpm_curve_build (void)
+{
+    uint_fast8_t idx;
+    uint32_t rpm_max = (uint32_t)fan_setting.rpm_max, bp_rpm = (uint32_t)fan_setting.rpm_breakpoint,
+             bp_level = (fan_setting.rpm_breakpoint_duty * 255 + 50) / 100;
+
+    rpm_curve.rpm_min = (uint32_t)fan_setting.rpm_min;
+    memset(rpm_curve.rpm_last, 0, sizeof(rpm_curve.rpm_last));
+
+    if(rpm_max <= rpm_curve.rpm_min) {
+        rpm_curve.step = 0;
+        return;
+    }
+
+    rpm_curve.step = (rpm_max - rpm_curve.rpm_min + FAN_RPM_LUT_SIZE - 2) / (FAN_RPM_LUT_SIZE - 1);
+
+    if(bp_rpm <= rpm_curve.rpm_min || bp_rpm >= rpm_max)
+        bp_rpm = 0; // No breakpoint, linear curve
+
+    for(idx = 0; idx < FAN_RPM_LUT_SIZE; idx++) {
+
+        uint32_t rpm = rpm_curve.rpm_min + idx * rpm_curve.step;
+
+        if(rpm >= rpm_max)
+            rpm_curve.lut[idx] = 255;
+        else if(bp_rpm == 0)
+            rpm_curve.lut[idx] = (rpm - rpm_curve.rpm_min) * 255 / (rpm_max - rpm_curve.rpm_min);
+        else if(rpm < bp_rpm)
+            rpm_curve.lut[idx] = (rpm - rpm_curve.rpm_min) * bp_level / (bp_rpm - rpm_curve.rpm_min);
+        else
+            rpm_curve.lut[idx] = bp_level + (rpm - bp_rpm) * (255 - bp_level) / (rpm_max - bp_rpm);
+    }
+}
+
+// Returns curve level (0 - 255) for RPM, linear interpolation between table entries.
+static uint_fast8_t fan_rpm_level (uint32_t rpm)
+{
+    uint32_t offset, idx;
+
+    if(rpm <= rpm_curve.rpm_min)
+        return rpm_curve.lut[0];
+
+    offset = rpm - rpm_curve.rpm_min;
+
+    if((idx = offset / rpm_curve.step) >= FAN_RPM_LUT_SIZE - 1)
+        return rpm_curve.lut[FAN_RPM_LUT_SIZE - 1];
+
+    return rpm_curve.lut[idx] + ((int32_t)rpm_curve.lut[idx + 1] - (int32_t)rpm_curve.lut[idx]) * (int32_t)(offset - idx * rpm_curve.step) / (int32_t)rpm_curve.step;
+}
+
+// Set duty of fans in mask linked to spindle id that follows spindle RPM,
+// changes within the hysteresis band of the spindle are ignored.
+static void fans_rpm_update (uint32_t mask, uint_fast8_t id, float rpm, bool force)
+{
+    uint32_t value = rpm > 0.0f ? (uint32_t)rpm : 0, last = rpm_curve.rpm_last[id];
+
+    if(mask && rpm_curve.step && (force || (value > last ? value - last : last - value) >= fan_setting.rpm_hysteresis)) {
+
+        uint_fast8_t idx = FANS_ENABLE, level = fan_rpm_level(value);
+
+        rpm_curve.rpm_last[id] = value;
+
+        do {
+            fan_t *fan = &fans[--idx];
+            if((mask & bit(idx)) && fan->flags.rpm && fan->flags.linked) {
+                uint_fast8_t duty = fan->duty_min + (fan->duty_max > fan->duty_min ? (fan->duty_max - fan->duty_min) * level / 255 : 0);
+                fan_update_duty(idx, duty ? duty : 1); // Keep fan running at lowest speed
+            }
+        } while(idx);
+    }
+}
+
+// Returns fans wanted on by the currently active link sources.
+static uint32_t fans_link_wanted (void)
+{
+    uint32_t wanted = 0;
+    uint_fast8_t id = N_SPINDLE;
+
+    do {
+        if(spindle_state[--id].on)
+            wanted |= spindle_fans[id] & ~air_fans;
+    } while(id);
+
+    if(coolant_state.flood)
+        wanted |= link_fans[FanLink_Flood];
+    if(coolant_state.mist)
+        wanted |= link_fans[FanLink_Mist];
+    if(program_running)
+        wanted |= link_fans[FanLink_Program];
+
+    return wanted;
+}
+
+// Common handling of link source changes, linked is the precomputed mask of fans linked to the source
+// and the source state must be updated before calling. Fans are turned on when a source becomes active
+// and turned off after their off delay when none of the sources they are linked to are active.
+// Only fans turned on by a link source are turned off by it.
+static void fans_link_changed (uint32_t linked, bool on)
+{
+    uint32_t mask = 0;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    if(!on)
+        linked &= ~fans_link_wanted();
+
+    if(linked) do {
+        fan_t *fan = &fans[--idx];
+        if((linked & bit(idx)) && (on || fan->flags.linked)) {
+            if(on && !fan->flags.on)
+                fan->flags.linked = On;
+            bit_true(mask, bit(idx));
+        }
+    } while(idx);
+
+    if(mask) {
+        if(on)
+            fans_on_staggered(mask);
+        else
+            fans_off_delayed(mask);
+    }
+}
+
+static void onSpindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
+{
+    static const spindle_state_t changed_mask = { .on = On, .ccw = On };
+
+    FAN_PROFILE_START();
+
+    if(air_fans)
+        laser_firing = state.on && rpm > 0.0f;
+
+    // Skip RPM only updates, fans only care about on/off changes.
+    if(((state.value ^ spindle_state[spindle->id].value) & changed_mask.value) == 0) {
+        if(state.on)
+            fans_rpm_update(spindle_fans[spindle->id], spindle->id, rpm, false);
+        FAN_PROFILE_END(FanProfile_SpindleSetState);
+        on_spindle_set_state[spindle->id](spindle, state, rpm);
+        return;
+    }
+
+    spindle_state[spindle->id] = state;
+
+    uint32_t linked = spindle_fans[spindle->id] & ~air_fans;
+
+    // Set speed after linking, fans_rpm_update() only updates linked fans
+    if(linked) {
+        fans_link_changed(linked, state.on);
+        if(state.on)
+            fans_rpm_update(linked, spindle->id, rpm, true);
+    }
+
+    FAN_PROFILE_END(FanProfile_SpindleSetState);
+
+    on_spindle_set_state[spindle->id](spindle, state, rpm);
+}
+
+// Start spindle linked fans when a spindle on command is parsed, ahead of the planner buffer being
+// drained and the spindle actually started. If any fan was started the parser waits, as for a G4 dwell,
+// for the planner buffer to empty and then for the remainder of the lead time so the spindle callback never blocks.
+// Fans already running, e.g. in their off delay, does not delay the spindle. Not in laser mode.
+// Waiting in the parser is intended: the core synchronizes the planner for the spindle command anyway and there
+// is no planner block for a dwell, so the lead time adds the same stall as a G4 before M3/M4 would. delay_sec()
+// runs the realtime loop so feed hold and reset are handled while waiting. The lead time is shared by all spindles.
+static void onSpindleProgrammed (spindle_ptrs_t *spindle, spindle_state_t state, float rpm, spindle_rpm_mode_t mode)
+{
+    uint32_t mask, started = 0;
+
+    if(state.on && spindle->id >= 0 && spindle->id < N_SPINDLE && (mask = spindle_fans[spindle->id] & ~air_fans) &&
+        !spindle_state[spindle->id].on && fan_setting.lead_time > 0.0f && state_get() != STATE_CHECK_MODE) {
+
+        uint_fast8_t idx = FANS_ENABLE;
+
+        do {
+            fan_t *fan = &fans[--idx];
+            if((mask & bit(idx)) && fan->port != 0xFF && !fan->flags.on) {
+                fan->flags.linked = On;
+                bit_true(started, bit(idx));
+            }
+        } while(idx);
+
+        if(started) {
+
+            uint32_t started_at = hal.get_elapsed_ticks(), lead = (uint32_t)(fan_setting.lead_time * 1000.0f), ran;
+
+            fans_rpm_update(started, spindle->id, rpm, true);
+            fans_on_staggered(started);
+
+            if(settings.mode != Mode_Laser) {
+                protocol_buffer_synchronize();
+                if((ran = hal.get_elapsed_ticks() - started_at) < lead)
+                    delay_sec((float)(lead - ran) / 1000.0f, DelayMode_Dwell);
+            }
+        }
+    }
+
+    if(on_spindle_programmed)
+        on_spindle_programmed(spindle, state, rpm, mode);
+}
+
+static void onCoolantSetState (coolant_state_t state)
+{
+    coolant_state_t changed = { .value = state.value ^ coolant_state.value };
+
+    coolant_set_state(state);
+
+    coolant_state = state;
+
+    if(changed.flood && link_fans[FanLink_Flood])
+        fans_link_changed(link_fans[FanLink_Flood], state.flood);
+
+    if(changed.mist && link_fans[FanLink_Mist])
+        fans_link_changed(link_fans[FanLink_Mist], state.mist);
+}
+
+// Drop running standby fans to the standby duty, or turn them off, when idle for the standby delay.
+// Temperature controlled fans are not affected.
+static void fans_standby_enter (void)
+{
+    uint32_t off = 0;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    do {
+        fan_t *fan = &fans[--idx];
+        if((fan_setting.standby_link & bit(idx)) && fan->port != 0xFF && fan->flags.on && !fan->flags.temp) {
+            bit_true(standby_mask, bit(idx));
+            if(fan->flags.analog && standby_duty) {
+                fan->standby = fan->duty;
+                fan_update_duty(idx, standby_duty);
+            } else {
+                fan->standby = 0;
+                bit_true(off, bit(idx));
+                if(fan->flags.linked)
+                    bit_true(standby_linked, bit(idx));
+            }
+        }
+    } while(idx);
+
+    if(off)
+        fans_set_mask(off, 0);
+}
+
+// Restore fans in standby to the state before standby.
+static void fans_standby_exit (void)
+{
+    uint32_t on = 0;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    do {
+        fan_t *fan = &fans[--idx];
+        if(standby_mask & bit(idx)) {
+            if(fan->standby)
+                fan_update_duty(idx, fan->standby);
+            else
+                bit_true(on, bit(idx));
+        }
+    } while(idx);
+
+    standby_mask = 0;
+
+    if(on) {
+        fans_set_mask(on, on);
+        idx = FANS_ENABLE;
+        do {
+            if(standby_linked & bit(--idx))
+                fans[idx].flags.linked = On;
+        } while(idx);
+    }
+
+    standby_linked = 0;
+}
+
+// A program is considered running while in a cycle or hold state, idle periods shorter than
+// the off delay of program linked fans does not turn them off.
+static void onStateChange (sys_state_t state)
+{
+    bool running = !!(state & (STATE_CYCLE|STATE_HOLD|STATE_TOOL_CHANGE|STATE_SAFETY_DOOR));
+
+    if(running != program_running) {
+        program_running = running;
+        if(link_fans[FanLink_Program])
+            fans_link_changed(link_fans[FanLink_Program], running);
+    }
+
+    // Standby is entered via the shared timer after being idle or sleeping for the standby delay
+    // and left on any other state, fans are restored on cycle start, jog, homing or tool change.
+    if(state == STATE_IDLE || (state & STATE_SLEEP)) {
+        if(fan_setting.standby_link && fan_setting.standby_delay && standby_at == 0 && standby_mask == 0)
+            fan_deadline_set(&standby_at, (uint32_t)fan_setting.standby_delay * 60000);
+    } else {
+        standby_at = 0;
+        if(standby_mask && (state & (STATE_CYCLE|STATE_JOG|STATE_HOMING|STATE_TOOL_CHANGE)))
+            fans_standby_exit();
+    }
+
+    if(on_state_change)
+        on_state_change(state);
+}
+
+// Called from the stepper interrupt in laser mode, only records if the laser is firing.
+static void onSpindleUpdatePWM (spindle_ptrs_t *spindle, uint_fast16_t pwm)
+{
+    on_spindle_update_pwm[spindle->id](spindle, pwm);
+
+    if(air_fans)
+        laser_firing = pwm != spindle_pwm_off[spindle->id] && spindle_state[spindle->id].on;
+}
+
+// Each selected spindle is wrapped once, the original set_state function is kept per spindle id.
+static bool onSpindleSelect (spindle_ptrs_t *spindle)
+{
+    if(spindle->id >= 0 && spindle->id < N_SPINDLE && spindle->set_state != onSpindleSetState) {
+        on_spindle_set_state[spindle->id] = spindle->set_state;
+        spindle->set_state = onSpindleSetState;
+        if(spindle->cap.laser && spindle->update_pwm && spindle->get_pwm) {
+            spindle_pwm_off[spindle->id] = spindle->get_pwm(spindle, 0.0f);
+            on_spindle_update_pwm[spindle->id] = spindle->update_pwm;
+            spindle->update_pwm = onSpindleUpdatePWM;
+        }
+    }
+
+    return on_spindle_select == NULL || on_spindle_select(spindle);
+}
+
+static void onProgramCompleted (program_flow_t program_flow, bool check_mode)
+{
+    if(sync_queue.head != sync_queue.tail)
+        fans_sync_poll();
+
+    fans_off_delayed(FANS_ALL);
+    fans_override_reset(FANS_ALL);
+
+    if(!check_mode && stats_unsaved >= FAN_STATS_MIN_SAVE)
+        fan_stats_save();
+
+    if(settings_dirty) {
+        task_delete(fan_settings_flush, NULL);
+        fan_settings_write();
+    }
+
+    if(on_program_completed)
+        on_program_completed(program_flow, check_mode);
+}
+
+// Write value as fixed width hex, no terminator is added.
+static void fan_hex (char *s, uint32_t value, uint_fast8_t digits)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    do {
+        s[--digits] = hex[value & 0x0F];
+        value >>= 4;
+    } while(digits);
+}
+
+// Compact fixed width hex report: temperature in 0.1 degC (8000 if no sensor) followed by
+// flags, output duty and RPM for each fan. Only emitted when changed since last report or on full reports.
+static void fan_report_compact (stream_write_ptr stream_write, bool force)
+{
+    static char buf[FAN_REPORT_SIZE] = "|FX:", last[FAN_REPORT_SIZE] = "";
+
+    char *s = buf + 4;
+    uint_fast8_t idx;
+
+    fan_hex(s, temp_ctrl.port == 0xFF ? 0x8000 : (uint16_t)temp_ctrl.temp, 4);
+    s += 4;
+
+    for(idx = 0; idx < FANS_ENABLE; idx++) {
+        fan_t *fan = &fans[idx];
+        fan_hex(s, (fan->port != 0xFF) | (fan->flags.on << 1) | (fan->flags.tach << 2) | (fan->flags.stalled << 3) | (fan->flags.temp << 4), 2);
+        fan_hex(s + 2, fan->flags.on ? (fan->ramp ? fan->ramp : fan_duty_out(fan)) : 0, 2);
+        fan_hex(s + 4, fan->rpm, 4);
+        s += 8;
+    }
+
+    *s = '\0';
+
+    if(force || memcmp(buf, last, FAN_REPORT_SIZE)) {
+        memcpy(last, buf, FAN_REPORT_SIZE);
+        stream_write(buf);
+    }
+}
+
+static void onRealtimeReport (stream_write_ptr stream_write, report_tracking_flags_t report)
+{
+    FAN_PROFILE_START();
+
+    if(report.fan) {
+
+        static const fan_flags_t on = { .on = On };
+        uint_fast8_t idx = FANS_ENABLE;
+
+        stream_write("|Fan:");
+        stream_write(uitoa(fans_get_mask(on)));
+
+        do {
+            idx--;
+            fans[idx].reported = fan_report_state(&fans[idx]);
+        } while(idx);
+
+        fans_dirty = 0;
+        report_at = hal.get_elapsed_ticks();
+    }
+
+    static const fan_flags_t tach = { .tach = On };
+    uint32_t mask;
+
+    if(fan_setting.compact_report)
+        fan_report_compact(stream_write, report.all);
+    else if((mask = fans_get_mask(tach))) {
+
+        uint_fast8_t idx = 0;
+
+        stream_write("|FanRPM:");
+        do {
+            stream_write(uitoa(fans[idx].rpm));
+            if((mask >>= 1))
+                stream_write(",");
+            idx++;
+        } while(mask);
+    }
+
+    static const fan_flags_t analog = { .analog = On };
+
+    if((report.overrides || report.all || ovr_changed) && (mask = fans_get_mask(analog))) {
+
+        uint_fast8_t idx = 0;
+
+        ovr_changed = false;
+        stream_write("|FO:");
+        stream_write(ovr_fan == 0xFF ? "-1" : uitoa(ovr_fan));
+        do {
+            stream_write(",");
+            stream_write(uitoa(fans[idx].override));
+            idx++;
+        } while((mask >>= 1));
+    }
+
+    FAN_PROFILE_END(FanProfile_RealtimeReport);
+
+    if(on_realtime_report)
+        on_realtime_report(stream_write, report);
+}
+
+// Called from the stream receive interrupt, override commands are only queued here.
+static bool onUnknownRealtimeCmd (char c)
+{
+    if((uint8_t)c >= CMD_OVERRIDE_FAN_RESET && (uint8_t)c <= CMD_OVERRIDE_FAN_SELECT) {
+        uint_fast8_t next = (ovr_head + 1) & (FAN_OVR_QUEUE_SIZE - 1);
+        if(next != ovr_tail) {
+            ovr_cmd[ovr_head] = (uint8_t)c;
+            ovr_head = next;
+        }
+        return true;
+    }
+
+    return on_unknown_realtime_cmd != NULL && on_unknown_realtime_cmd(c);
+}
+
+// Reset duty overrides of fans in mask to 100%.
+static void fans_override_reset (uint32_t mask)
+{
+    uint_fast8_t idx = FANS_ENABLE;
+
+    do {
+        if((mask & bit(--idx)) && fans[idx].override != 100) {
+            fans[idx].override = 100;
+            ovr_changed = true;
+            if(fans[idx].flags.analog && fans[idx].flags.on && !fans[idx].ramp)
+                fan_output(idx);
+        }
+    } while(idx);
+
+    fans_report_check(mask);
+}
+
+// Apply queued override commands to the selected analog fan(s), runs in the foreground.
+static void fans_override_poll (void)
+{
+    static const fan_flags_t analog = { .analog = On };
+
+    uint32_t mask = fans_get_mask(analog);
+
+    do {
+        uint8_t cmd = ovr_cmd[ovr_tail];
+        uint32_t target = ovr_fan == 0xFF ? mask : (mask & bit(ovr_fan));
+        int_fast16_t delta = 0;
+        uint_fast8_t idx;
+
+        ovr_tail = (ovr_tail + 1) & (FAN_OVR_QUEUE_SIZE - 1);
+
+        switch(cmd) {
+
+            case CMD_OVERRIDE_FAN_RESET:
+                fans_override_reset(target);
+                break;
+
+            case CMD_OVERRIDE_FAN_COARSE_PLUS:
+                delta = FAN_OVERRIDE_COARSE;
+                break;
+
+            case CMD_OVERRIDE_FAN_COARSE_MINUS:
+                delta = -FAN_OVERRIDE_COARSE;
+                break;
+
+            case CMD_OVERRIDE_FAN_FINE_PLUS:
+                delta = FAN_OVERRIDE_FINE;
+                break;
+
+            case CMD_OVERRIDE_FAN_FINE_MINUS:
+                delta = -FAN_OVERRIDE_FINE;
+                break;
+
+            case CMD_OVERRIDE_FAN_SELECT:
+                idx = ovr_fan == 0xFF ? 0 : ovr_fan + 1;
+                while(idx < FANS_ENABLE && !(mask & bit(idx)))
+                    idx++;
+                ovr_fan = idx < FANS_ENABLE ? idx : 0xFF;
+                ovr_changed = true;
+                break;
+        }
+
+        if(delta) for(idx = 0; idx < FANS_ENABLE; idx++) {
+            if(target & bit(idx)) {
+                fan_t *fan = &fans[idx];
+                int_fast16_t value = fan->override + delta;
+                value = value < FAN_OVERRIDE_MIN ? FAN_OVERRIDE_MIN : (value > FAN_OVERRIDE_MAX ? FAN_OVERRIDE_MAX : value);
+                if(value != fan->override) {
+                    fan->override = (uint8_t)value;
+                    ovr_changed = true;
+                    if(fan->flags.on && !fan->ramp)
+                        fan_output(idx);
+                }
+            }
+        }
+
+        if(delta)
+            fans_report_check(target);
+
+    } while(ovr_tail != ovr_head);
+}
+
+static void onAccessoryOverride (uint8_t cmd)
+{
+    if(cmd == CMD_OVERRIDE_FAN0_TOGGLE && fans[0].port != 0xFF)
+        fan_set_state(0, !fan_get_state(0));
+    else if(on_unknown_accessory_override)
+        on_unknown_accessory_override(cmd);
+}
+
+bool fan_get_state (uint8_t fan)
+{
+    return fan < FANS_ENABLE && fans[fan].port != 0xFF && fans[fan].flags.on;
+}
+
+// Returns measured fan speed, 0 if the fan has no tachometer input.
+uint16_t fan_get_rpm (uint8_t fan)
+{
+    return fan < FANS_ENABLE && fans[fan].flags.tach ? fans[fan].rpm : 0;
+}
+
+// Copy state of all fans in one call.
+void fans_get_all (fans_state_t *state)
+{
+    uint_fast8_t idx = FANS_ENABLE;
+
+    memset(state, 0, sizeof(fans_state_t));
+
+    state->n_fans = FANS_ENABLE;
+    state->temperature = temp_ctrl.port == 0xFF ? INT16_MIN : temp_ctrl.temp;
+
+    do {
+        fan_t *fan = &fans[--idx];
+        if(fan->port != 0xFF) {
+            bit_true(state->available, bit(idx));
+            if(fan->flags.on) {
+                bit_true(state->on, bit(idx));
+                state->output[idx] = fan->flags.analog ? (fan->ramp ? fan->ramp : fan_duty_out(fan)) : 255;
+            }
+            if(fan->flags.analog)
+                bit_true(state->analog, bit(idx));
+            if(fan->flags.stalled)
+                bit_true(state->stalled, bit(idx));
+            state->duty[idx] = fan->duty;
+            state->override[idx] = fan->override;
+            state->rpm[idx] = fan_get_rpm(idx);
+        }
+    } while(idx);
+}
+
+// Returns pointer to the fan event handlers.
+fans_events_t *fans_get_events (void)
+{
+    return &fan_events;
+}
+
+// Apply override and clamp non-zero duty to the configured range.
+static inline uint_fast8_t fan_duty_out (fan_t *fan)
+{
+    uint_fast16_t duty = fan->override == 100 ? fan->duty : (fan->duty * fan->override + 50) / 100;
+
+    return fan->duty == 0 ? 0 : (duty < fan->duty_min ? fan->duty_min : (duty > fan->duty_max ? fan->duty_max : duty));
+}
+
+// Output backends, fans with speed control are flagged analog regardless of backend.
+// Multiple aux digital outputs are written by fans_output_digital().
+
+static void fan_output_aux_digital (uint_fast8_t idx)
+{
+    hal.port.digital_out(fans[idx].port, fans[idx].flags.on);
+}
+
+static void fan_output_aux_analog (uint_fast8_t idx)
+{
+    fan_t *fan = &fans[idx];
+
+    hal.port.analog_out(fan->port, fan->flags.on ? (float)(fan->ramp ? fan->ramp : fan_duty_out(fan)) * (100.0f / 255.0f) : 0.0f);
+}
+
+#if FANS_MODBUS
+
+// Speed commands are sent without waiting for the bus. Only one command per fan is in flight,
+// changes made while a command is pending are coalesced and the latest speed is sent on completion.
+
+static void fan_modbus_done (uint_fast8_t idx)
+{
+    bit_false(modbus_busy, bit(idx));
+
+    if(modbus_dirty & bit(idx))
+        protocol_enqueue_foreground_task(fans_modbus_flush, NULL);
+}
+
+static void fan_modbus_rx_packet (modbus_message_t *msg)
+{
+    fan_modbus_done((uint_fast8_t)(uintptr_t)msg->context);
+}
+
+static void fan_modbus_rx_exception (uint8_t code, void *context)
+{
+    fan_modbus_done((uint_fast8_t)(uintptr_t)context);
+}
+
+static const modbus_callbacks_t fan_modbus_callbacks = {
+    .on_rx_packet = fan_modbus_rx_packet,
+    .on_rx_exception = fan_modbus_rx_exception
+};
+
+// Send the current speed of Modbus fans with pending changes and no command in flight.
+// Fans are left pending if the Modbus queue is full, the send is then retried from the fan tick.
+static void fans_modbus_flush (void *data)
+{
+    uint32_t pending = modbus_dirty & ~modbus_busy;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    if(pending) do {
+        if(pending & bit(--idx)) {
+
+            fan_t *fan = &fans[idx];
+            fan_modbus_config_t *cfg = &fan_setting.modbus[idx];
+            uint16_t value = fan->flags.on ? (uint16_t)(((uint32_t)(fan->ramp ? fan->ramp : fan_duty_out(fan)) * cfg->max_value + 127) / 255) : 0;
+
+            modbus_message_t cmd = {
+                .context = (void *)(uintptr_t)idx,
+                .crc_check = false,
+                .adu[0] = cfg->address,
+                .adu[1] = ModBus_WriteRegister,
+                .adu[2] = (char)(cfg->reg >> 8),
+                .adu[3] = (char)(cfg->reg & 0xFF),
+                .adu[4] = (char)(value >> 8),
+                .adu[5] = (char)(value & 0xFF),
+                .tx_length = 8,
+                .rx_length = 8
+            };
+
+            // Flagged busy before sending as the completion callback may be called from modbus_send()
+            bit_false(modbus_dirty, bit(idx));
+            bit_true(modbus_busy, bit(idx));
+
+            if(!modbus_send(&cmd, &fan_modbus_callbacks, false)) {
+                bit_false(modbus_busy, bit(idx));
+                bit_true(modbus_dirty, bit(idx));
+            }
+        }
+    } while(idx);
+}
+
+static void fan_output_modbus (uint_fast8_t idx)
+{
+    bit_true(modbus_dirty, bit(idx));
+
+    if(!(modbus_busy & bit(idx)))
+        fans_modbus_flush(NULL);
+}
+
+#endif
+
+static void fan_output (uint_fast8_t idx)
+{
+    fans[idx].output(idx);
+}
+
+// Write digital outputs of fans in mask, in a single call if the driver has registered a multi-bit write function.
+// Ports numbered 32 and above are written one by one.
+static void fans_output_digital (uint32_t mask)
+{
+    uint_fast8_t idx = FANS_ENABLE;
+
+    if(digital_out_mask) {
+
+        uint32_t ports = 0, value = 0;
+
+        do {
+            fan_t *fan = &fans[--idx];
+            if(mask & bit(idx)) {
+                if(fan->port < 32) {
+                    bit_true(ports, bit(fan->port));
+                    if(fan->flags.on)
+                        bit_true(value, bit(fan->port));
+                } else
+                    hal.port.digital_out(fan->port, fan->flags.on);
+            }
+        } while(idx);
+
+        if(ports)
+            digital_out_mask(ports, value);
+
+    } else do {
+        if(mask & bit(--idx))
+            hal.port.digital_out(fans[idx].port, fans[idx].flags.on);
+    } while(idx);
+}
+
+// Register driver function for writing several digital aux outputs in one operation.
+void fans_register_digital_out_mask (fans_digital_out_mask_ptr fn)
+{
+    digital_out_mask = fn;
+}
+
+// Set state of the fans in mask to the corresponding bits in value, cancels any pending delayed turn off.
+// Outputs are only touched when a change is required, report flag only when the reported state changes.
+void fans_set_mask (uint32_t mask, uint32_t value)
+{
+    uint32_t changed = 0, digital = 0;
+    uint_fast8_t idx = FANS_ENABLE;
+
+    FAN_PROFILE_START();
+
+    do {
+        fan_t *fan = &fans[--idx];
+        if((mask & bit(idx)) && fan->port != 0xFF) {
+
+            bool on = !!(value & bit(idx));
+
+            fan->off_at = fan->start_at = 0; // The shared timer is not rearmed, it will find nothing to do if no other deadlines are pending.
+
+            if(!on)
+                fan->flags.linked = Off;
+
+            if(fan->flags.on != on) {
+                bit_true(changed, bit(idx));
+                if((fan->flags.on = on)) {
+                    fan->on_at = hal.get_elapsed_ticks();
+                    if(fan->flags.analog && ramp_step && fan_duty_out(fan) > ramp_step)
+                        fan->ramp = ramp_step;
+                } else
+                    fan->ramp = 0;
+                if(fan->flags.analog)
+                    fan_output(idx);
+                else
+                    bit_true(digital, bit(idx));
+            }
+        }
+    } while(idx);
+
+    // Digital outputs are written together after all changes has been collected.
+    if(digital)
+        fans_output_digital(digital);
+
+    if(changed)
+        fans_report_check(changed);
+
+    FAN_PROFILE_END(FanProfile_SetMask);
+}
+
+void fan_set_state (uint8_t fan, bool on)
+{
+    if(fan < FANS_ENABLE)
+        fans_set_mask(bit(fan), on ? bit(fan) : 0);
+}
+
+// Set commanded duty (1 - 255) of fan without changing its on/off state.
+static void fan_update_duty (uint_fast8_t fan, uint8_t duty)
+{
+    if(fans[fan].duty != duty) {
+        fans[fan].duty = duty;
+        if(fans[fan].flags.analog && fans[fan].flags.on) {
+            fans_report_check(bit(fan));
+            if(!fans[fan].ramp)
+                fan_output(fan);
+        }
+    }
+}
+
+// Set commanded duty (0 - 255) of fans in mask in a single update, 0 turns the fans off.
+// Digital fans are turned on by any non-zero value.
+void fans_set_duty (uint32_t mask, uint8_t duty)
+{
+    uint_fast8_t idx = FANS_ENABLE;
+
+    // Commanded fans are no longer restored from standby.
+    standby_mask &= ~mask;
+    standby_linked &= ~mask;
+
+    if(duty) do {
+        if((mask & bit(--idx)) && fans[idx].port != 0xFF)
+            fan_update_duty(idx, duty);
+    } while(idx);
+
+    fans_set_mask(mask, duty ? mask : 0);
+}
+
+// Set commanded duty (0 - 255) of fan, 0 turns the fan off.
+void fan_set_duty (uint8_t fan, uint8_t duty)
+{
+    if(fan < FANS_ENABLE)
+        fans_set_duty(bit(fan), duty);
+}
+
+// Find highest registered spindle id for the spindle binding settings.
+// Driving a fan from an unused driver spindle is not supported, fans are always mapped to aux ports.
+static bool spindle_enumerate (spindle_info_t *spindle, void *data)
+{
+    if(spindle->id >= *(int8_t *)data && spindle->id < N_SPINDLE)
+        *(int8_t *)data = spindle->id;
+
+    return false;
+}
+
+// $FANRT - report runtime in hours and energy in hours at full duty for each fan, $FANRT=R resets statistics.
+// Statistics are kept since startup only if no NVS space could be allocated for them.
+static status_code_t fan_runtime_cmd (sys_state_t state, char *args)
+{
+    uint_fast8_t idx;
+
+    if(args) {
+        if(!(args[0] == 'R' && args[1] == '\0'))
+            return Status_InvalidStatement;
+        memset(&fan_stats, 0, sizeof(fan_stats_t));
+        stats_unsaved = 1;
+        fan_stats_save();
+    }
+
+    if(!nvs_stats)
+        hal.stream.write("[FANRT:not stored]" ASCII_EOL);
+
+    for(idx = 0; idx < FANS_ENABLE; idx++) {
+        if(fans[idx].port != 0xFF) {
+            hal.stream.write("[FANRT:");
+            hal.stream.write(uitoa(idx));
+            hal.stream.write("|");
+            hal.stream.write(ftoa((float)fan_stats.runtime[idx] / 3600.0f, 1));
+            hal.stream.write("|");
+            hal.stream.write(ftoa((float)fan_stats.energy[idx] / 3600.0f, 1));
+            hal.stream.write("]" ASCII_EOL);
+        }
+    }
+
+    return Status_OK;
+}
+
+#if FANS_PROFILE
+
+// $FANSTAT - report min/avg/max execution time and number of calls for profiled callbacks, $FANSTAT=R resets.
+static status_code_t fan_profile_cmd (sys_state_t state, char *args)
+{
+    uint_fast8_t idx;
+
+    if(args) {
+        if(!(args[0] == 'R' && args[1] == '\0'))
+            return Status_InvalidStatement;
+        memset(fan_profile, 0, sizeof(fan_profile));
+    }
+
+    for(idx = 0; idx < FanProfile_N; idx++) {
+        fan_profile_t profile = fan_profile[idx];
+        hal.stream.write("[FANSTAT:");
+        hal.stream.write(fan_profile_name[idx]);
+        hal.stream.write("|");
+        hal.stream.write(uitoa(profile.min));
+        hal.stream.write("|");
+        hal.stream.write(uitoa(profile.count ? (uint32_t)(profile.total / profile.count) : 0));
+        hal.stream.write("|");
+        hal.stream.write(uitoa(profile.max));
+        hal.stream.write("|");
+        hal.stream.write(uitoa(profile.count));
+        hal.stream.write("|" FAN_PROFILE_UNIT "]" ASCII_EOL);
+    }
+
+    return Status_OK;
+}
+
+#endif
+
+// Install hooks and start the shared tick, called once when the first fan is available.
+static void fan_setup (void)
+{
+    static bool is_setup = false;
+    static const sys_command_t fan_command_list[] = {
+        {"FANRT", fan_runtime_cmd, {0}, { .str = "report fan runtime statistics, $FANRT=R to reset" } },
+#if FANS_PROFILE
+        {"FANSTAT", fan_profile_cmd, {0}, { .str = "report fan callback execution times, $FANSTAT=R to reset" } }
+#endif
+    };
+
+    static sys_commands_t fan_commands = {
+        .n_commands = sizeof(fan_command_list) / sizeof(sys_command_t),
+        .commands = fan_command_list
+    };
+
+    if(is_setup)
+        return;
+
+    is_setup = true;
+
+    memcpy(&user_mcode, &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
+
+    grbl.user_mcode.check = userMCodeCheck;
+    grbl.user_mcode.validate = userMCodeValidate;
+    grbl.user_mcode.execute = userMCodeExecute;
+
+    driver_reset = hal.driver_reset;
+    hal.driver_reset = driverReset;
+
+    on_realtime_report = grbl.on_realtime_report;
+    grbl.on_realtime_report = onRealtimeReport;
+
+    on_unknown_accessory_override = grbl.on_unknown_accessory_override;
+    grbl.on_unknown_accessory_override = onAccessoryOverride;
+
+    on_unknown_realtime_cmd = grbl.on_unknown_realtime_cmd;
+    grbl.on_unknown_realtime_cmd = onUnknownRealtimeCmd;
+
+    on_state_change = grbl.on_state_change;
+    grbl.on_state_change = onStateChange;
+
+    if(hal.coolant.set_state) {
+        coolant_set_state = hal.coolant.set_state;
+        hal.coolant.set_state = onCoolantSetState;
+    }
+
+    on_program_completed = grbl.on_program_completed;
+    grbl.on_program_completed = onProgramCompleted;
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = onExecuteRealtime;
+
+    on_spindle_programmed = grbl.on_spindle_programmed;
+    grbl.on_spindle_programmed = onSpindleProgrammed;
+
+    system_register_commands(&fan_commands);
+
+    stats_at = tach_sampled_at = hal.get_elapsed_ticks();
+    task_add_delayed(fan_tick, NULL, FAN_TICK_PERIOD);
+}
+
+// Returns fan number for per fan setting id.
+static inline uint_fast8_t fan_setting_index (setting_id_t id)
+{
+    return id >= Setting_FanSettingsExtBase
+            ? (id - Setting_FanSettingsExtBase) / 10
+            : (id >= Setting_FanSettingsBase ? (id - Setting_FanSettingsBase) / 10 : id - Setting_FanPort0);
+}
+
+static inline uint8_t fan_n_ports (uint_fast8_t fan)
+{
+    return fan_setting.fan[fan].port_type == FanPort_Analog ? n_aports : n_ports;
+}
+
+// Returns true if output port was free at startup.
+static inline bool fan_port_free (bool analog, uint8_t port)
+{
+    return port < (analog ? n_aports : n_ports) && (port >= 32 || (port_map[analog] & bit(port)));
 }
 
-static void fan_off (void *data)
+// Build map of free output ports, called once at startup before any ports are claimed by the plugin.
+// Settings reloads and validation uses the map so ports are not rescanned.
+static void fan_ports_scan (void)
 {
-    fan_set_state(0, Off);
+    uint_fast8_t analog = 2, port;
+
+    do {
+        analog--;
+        port = analog ? n_aports : n_ports;
+        while(port) {
+            xbar_t *pin = hal.port.get_pin_info ? hal.port.get_pin_info(analog ? Port_Analog : Port_Digital, Port_Output, --port) : NULL;
+            if(pin == NULL || !pin->mode.claimed) {
+                n_free[analog]++;
+                if(port < 32)
+                    bit_true(port_map[analog], bit(port));
+            }
+        }
+    } while(analog);
+
+    port = (n_ports > n_aports ? n_ports : n_aports);
+    strcpy(max_port, uitoa(port ? port - 1 : 0));
 }
 
-static void userMCodeExecute (uint_fast16_t state, parser_block_t *gc_block)
+static bool is_setting_available (const setting_detail_t *setting, uint_fast16_t offset)
 {
-    bool handled = true;
-    uint_fast8_t fan = gc_block->words.p ? (uint8_t)gc_block->values.p : 0;
+    bool available;
 
-    if (state != STATE_CHECK_MODE)
-      switch(gc_block->user_mcode) {
+    if(setting->id >= Setting_FanSettingsExtBase) {
 
-        case Fan_On:
-            fan_set_state(fan, On);
-            break;
+        uint_fast8_t fan = fan_setting_index(setting->id);
 
-        case Fan_Off:
-            if(fan == 0)
-                task_delete(fan_off, NULL);
-            fan_set_state(fan, Off);
-            break;
+        if((available = n_free[0] > fan || n_free[1] > fan || FANS_MODBUS)) switch((setting->id - Setting_FanSettingsExtBase) % 10) {
 
-        default:
-            handled = false;
-            break;
+            case FanSettingExt_Spindle:
+                available = bit_istrue(fan_setting.spindle_link, bit(fan));
+                break;
+
+            case FanSettingExt_ModbusAddress:
+            case FanSettingExt_ModbusRegister:
+            case FanSettingExt_ModbusMax:
+                available = fan_setting.fan[fan].port_type == FanPort_Modbus;
+                break;
+
+            default:
+                break;
+        }
+    } else if(setting->id == Setting_FanSoftStart)
+        available = n_aports > 0;
+    else if(setting->id >= Setting_FanTempLink)
+        available = n_aiports > 0 && hal.port.wait_on_input != NULL;
+    else if(setting->id == Setting_FanStallAction)
+        available = n_iports > 0 && hal.port.register_interrupt_handler != NULL;
+    else if(setting->id >= Setting_FanRpmLink)
+        available = n_aports > 0;
+    else {
+
+        uint_fast8_t fan = fan_setting_index(setting->id);
+
+        if((available = n_free[0] > fan || n_free[1] > fan || FANS_MODBUS) && setting->id >= Setting_FanSettingsBase) switch((setting->id - Setting_FanSettingsBase) % 10) {
+
+            case FanSetting_DutyMin:
+            case FanSetting_DutyMax:
+                available = fan_setting.fan[fan].port_type != FanPort_Digital;
+                break;
+
+            case FanSetting_TachPort:
+                available = n_iports > 0 && hal.port.register_interrupt_handler != NULL;
+                break;
+
+            case FanSetting_TachPPR:
+            case FanSetting_StallRpm:
+            case FanSetting_StallGrace:
+                available = n_iports > 0 && fan_setting.fan[fan].tach_port < n_iports;
+                break;
+
+            default:
+                break;
+        }
     }
 
-    if(!handled && user_mcode.execute)
-        user_mcode.execute(state, gc_block);
+    return available;
 }
 
-static void driverReset (void)
+static inline bool is_tach_setting (setting_id_t setting)
 {
-    driver_reset();
-
-    uint32_t idx = FANS_ENABLE;
-    do {
-        fan_set_state(--idx, Off);
-    } while(idx);
+    return setting >= Setting_FanSettingsBase && setting < Setting_FanSettingsExtBase && (setting - Setting_FanSettingsBase) % 10 == FanSetting_TachPort;
 }
 
-static void onSpindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
+static bool fan_port_reassign (uint_fast8_t idx, uint8_t port);
+
+static status_code_t set_port (setting_id_t setting, float value)
 {
-    uint_fast8_t idx = FANS_ENABLE;
-    do {
-        if(bit_istrue(fans.spindle_link, bit(--idx))) {
+    status_code_t status;
 
-            if(!state.on && bit_isfalse(fans_linked, bit(idx)))
-                continue;
+    if((status = isintf(value) ? Status_OK : Status_BadNumberFormat) == Status_OK) {
+        uint_fast8_t idx = fan_setting_index(setting);
+        fan_config_t *fan = &fan_setting.fan[idx];
+        uint8_t port = value < 0.0f ? 0xFF : (uint8_t)value;
+        if(is_tach_setting(setting))
+            fan->tach_port = port;
+        // Accept either port type as the port type setting may be changed after the port.
+        else if(fan->port_type == FanPort_Modbus || (port != 0xFF && !(fan_port_free(false, port) || fan_port_free(true, port))))
+            status = Status_SettingValueOutOfRange;
+        else if(ports_loaded && !fan_port_reassign(idx, port))
+            status = Status_SettingValueOutOfRange;
+        else
+            fan->port = port;
+    }
+
+    return status;
+}
 
-            if(state.on && !fan_get_state(idx))
-                bit_true(fans_linked, bit(idx));
+static float get_port (setting_id_t setting)
+{
+    uint_fast8_t fan = fan_setting_index(setting);
 
-            if(idx == 0 && !state.on && fan_setting.fan0_off_delay > 0.0f)
-                task_add_delayed(fan_off, NULL, (uint32_t)(fan_setting.fan0_off_delay * 60.0f * 1000.0f));
-            else
-                fan_set_state(idx, state.on);
-        }
-    } while(idx);
+    if(is_tach_setting(setting))
+        return fan_setting.fan[fan].tach_port >= n_iports ? -1.0f : (float)fan_setting.fan[fan].tach_port;
 
-    on_spindle_set_state(spindle, state, rpm);
+    return fan_setting.fan[fan].port >= fan_n_ports(fan) ? -1.0f : (float)fan_setting.fan[fan].port;
 }
 
-static bool onSpindleSelect (spindle_ptrs_t *spindle)
+// Precompute linked fans for each spindle id.
+static void fans_spindle_map (void)
 {
-    on_spindle_set_state = spindle->set_state;
-    spindle->set_state = onSpindleSetState;
+    uint_fast8_t idx = FANS_ENABLE, id;
 
-    return on_spindle_select == NULL || on_spindle_select(spindle);
+    memset(spindle_fans, 0, sizeof(spindle_fans));
+
+    do {
+        idx--;
+        if(fans[idx].flags.spindle) for(id = 0; id < N_SPINDLE; id++) {
+            if(fan_setting.fan[idx].spindle == 0xFF || fan_setting.fan[idx].spindle == id)
+                bit_true(spindle_fans[id], bit(idx));
+        }
+    } while(idx);
 }
 
-static void onProgramCompleted (program_flow_t program_flow, bool check_mode)
+static status_code_t set_spindle_link (setting_id_t setting, uint32_t value)
 {
     uint_fast8_t idx = FANS_ENABLE;
+
+    fan_setting.spindle_link = value;
+
     do {
-        if(--idx == 0 && fans.port[0] != 0xFF && fan_setting.fan0_off_delay > 0.0f)
-            task_add_delayed(fan_off, NULL, (uint32_t)(fan_setting.fan0_off_delay * 60.0f * 1000.0f));
-        else
-            fan_set_state(idx, Off);
+        idx--;
+        fans[idx].flags.spindle = bit_istrue(fan_setting.spindle_link, bit(idx)) && fans[idx].port != 0xFF;
     } while(idx);
 
-    if(on_program_completed)
-        on_program_completed(program_flow, check_mode);
+    fans_spindle_map();
+
+    return Status_OK;
 }
 
-static void onRealtimeReport (stream_write_ptr stream_write, report_tracking_flags_t report)
+static status_code_t set_spindle_bind (setting_id_t setting, float value)
 {
-    if(report.fan) {
-        stream_write("|Fan:");
-        stream_write(uitoa(fans_on));
+    status_code_t status;
+
+    if((status = isintf(value) ? Status_OK : Status_BadNumberFormat) == Status_OK) {
+        fan_setting.fan[fan_setting_index(setting)].spindle = value < 0.0f ? 0xFF : (uint8_t)value;
+        fans_spindle_map();
     }
 
-    if(on_realtime_report)
-        on_realtime_report(stream_write, report);
+    return status;
 }
 
-static void onAccessoryOverride (uint8_t cmd)
+static float get_spindle_bind (setting_id_t setting)
 {
-    if(cmd == CMD_OVERRIDE_FAN0_TOGGLE && fans.port[0] != 0xFF)
-        fan_set_state(0, !fan_get_state(0));
-    else if(on_unknown_accessory_override)
-        on_unknown_accessory_override(cmd);
+    uint_fast8_t fan = fan_setting_index(setting);
+
+    return fan_setting.fan[fan].spindle >= N_SPINDLE ? -1.0f : (float)fan_setting.fan[fan].spindle;
 }
 
-bool fan_get_state (uint8_t fan)
+static uint32_t get_spindle_link (setting_id_t setting)
 {
-    return fans.port[fan] != 0xFF && !!(fans_on & (1 << fan));
+    return fan_setting.spindle_link;
 }
 
-void fan_set_state (uint8_t fan, bool on)
+static status_code_t set_rpm_link (setting_id_t setting, uint32_t value)
 {
-    if(fans.port[fan] != 0xFF) {
-
-        if(on)
-            bit_true(fans_on, bit(fan));
-        else {
-            bit_false(fans_on, bit(fan));
-            bit_false(fans_linked, bit(fan));
-        }
+    uint_fast8_t idx = FANS_ENABLE;
 
-        if(fan == 0)
-            task_delete(fan_off, NULL);
+    fan_setting.rpm_link = value;
 
-        sys.report.fan = On;
+    do {
+        idx--;
+        fans[idx].flags.rpm = bit_istrue(fan_setting.rpm_link, bit(idx)) && fans[idx].flags.analog;
+    } while(idx);
 
-        if(fan == 0 && fan_spindle_set_state) {
-            spindle_state_t state = {0};
-            state.on = on;
-            fan_spindle_set_state(NULL, state, 0.0f);
-        } else
-            hal.port.digital_out(fans.port[fan], on);
-    }
+    return Status_OK;
 }
 
-static bool spindle_enumerate (spindle_info_t *spindle, void *data)
+static uint32_t get_rpm_link (setting_id_t setting)
 {
-// TODO: needs evaluation - may be a dangerous approach to using the driver spindle...
-//    if(!spindle->is_current && (spindle->hal->type == SpindleType_Basic || spindle->hal->type == SpindleType_PWM))
-//        fan_spindle_set_state = spindle->hal->set_state;
-    return true;
+    return fan_setting.rpm_link;
 }
 
-static void fan_setup (void)
+static status_code_t set_temp_link (setting_id_t setting, uint32_t value)
 {
-    memcpy(&user_mcode, &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
-
-    grbl.user_mcode.check = userMCodeCheck;
-    grbl.user_mcode.validate = userMCodeValidate;
-    grbl.user_mcode.execute = userMCodeExecute;
+    uint_fast8_t idx = FANS_ENABLE;
 
-    driver_reset = hal.driver_reset;
-    hal.driver_reset = driverReset;
+    fan_setting.temp_link = value;
 
-    on_realtime_report = grbl.on_realtime_report;
-    grbl.on_realtime_report = onRealtimeReport;
+    do {
+        idx--;
+        fans[idx].flags.temp = bit_istrue(fan_setting.temp_link, bit(idx)) && fans[idx].port != 0xFF && temp_ctrl.port != 0xFF;
+    } while(idx);
 
-    on_unknown_accessory_override = grbl.on_unknown_accessory_override;
-    grbl.on_unknown_accessory_override = onAccessoryOverride;
+    return Status_OK;
+}
 
-    on_program_completed = grbl.on_program_completed;
-    grbl.on_program_completed = onProgramCompleted;
+static uint32_t get_temp_link (setting_id_t setting)
+{
+    return fan_setting.temp_link;
 }
 
-static bool is_setting_available (const setting_detail_t *setting, uint_fast16_t offset)
+// Move fan to another output port without a reboot, the output state is moved to the new port.
+// Ports cannot be returned to the core once claimed so the previous port is turned off and kept for
+// assignment to any fan. Runs from a $-setting command in the foreground, the fan is switched to the
+// new port before the linked fan masks are rebuilt so the spindle hook always sees a consistent state.
+static bool fan_port_reassign (uint_fast8_t idx, uint8_t port)
 {
-    bool available = false;
+    fan_t *fan = &fans[idx];
+    uint8_t old_port = fan->setting_port, claimed = port;
+    bool analog = old_port != 0xFF ? fan->flags.analog : fan_setting.fan[idx].port_type == FanPort_Analog;
+    uint_fast8_t i = FANS_ENABLE;
 
-    switch(setting->id) {
+    if(port == old_port)
+        return true;
 
-        case Setting_FanPort0:
-            available = n_ports >= 1;
-            break;
+    if(port != 0xFF) {
 
-#if FANS_ENABLE > 1
-        case Setting_FanPort1:
-            available = n_ports >= 2;
-            break;
-#endif
+        // Digital and analog ports are numbered separately, compare ports of the same type only.
+        do {
+            i--;
+            if(i != idx && fans[i].setting_port == port && fans[i].output == (analog ? fan_output_aux_analog : fan_output_aux_digital))
+                return false;
+        } while(i);
+
+        if(port < 32 && (port_released[analog] & bit(port))) {
+            bit_false(port_released[analog], bit(port));
+            claimed = port_released_claimed[analog][port];
+            if(hal.port.set_pin_description)
+                hal.port.set_pin_description(analog ? Port_Analog : Port_Digital, Port_Output, claimed, fan_names[idx]);
+        } else if(!(fan_port_free(analog, port) && ioport_claim(analog ? Port_Analog : Port_Digital, Port_Output, &claimed, fan_names[idx])))
+            return false;
+    }
 
-#if FANS_ENABLE > 2
-        case Setting_FanPort2:
-            available = n_ports >= 3;
-            break;
-#endif
+    if(old_port != 0xFF) {
+        if(analog)
+            hal.port.analog_out(fan->port, 0.0f);
+        else
+            hal.port.digital_out(fan->port, false);
+        if(old_port < 32) {
+            bit_true(port_released[analog], bit(old_port));
+            port_released_claimed[analog][old_port] = fan->port;
+        }
+        if(hal.port.set_pin_description)
+            hal.port.set_pin_description(analog ? Port_Analog : Port_Digital, Port_Output, fan->port, "Fan (unassigned)");
+    }
 
-#if FANS_ENABLE > 3
-        case Setting_FanPort3:
-            available = n_ports >= 4;
-            break;
-#endif
-        default:
-            break;
+    fan->setting_port = port;
+
+    if((fan->port = claimed) == 0xFF) {
+        fan->flags.on = fan->flags.linked = Off;
+        fan->off_at = fan->start_at = 0;
+        fan->ramp = 0;
+        n_fans--;
+    } else {
+        if(old_port == 0xFF) {
+            fan->flags.analog = analog;
+            fan->output = analog ? fan_output_aux_analog : fan_output_aux_digital;
+            fan->duty = 255;
+            if(n_fans++ == 0)
+                fan_setup();
+        }
+        fan_output(idx);
     }
 
-    return available;
+    set_spindle_link(Setting_FanToSpindleLink, fan_setting.spindle_link);
+    set_rpm_link(Setting_FanRpmLink, fan_setting.rpm_link);
+    set_temp_link(Setting_FanTempLink, fan_setting.temp_link);
+    fans_report_check(bit(idx));
+
+    return true;
 }
 
-static status_code_t set_float (setting_id_t setting, float value)
+static status_code_t set_temp_port (setting_id_t setting, float value)
 {
     status_code_t status;
 
     if((status = isintf(value) ? Status_OK : Status_BadNumberFormat) == Status_OK)
-      switch(setting) {
-
-        case Setting_FanPort0:
-            fan_setting.port[0] = value < 0.0f ? 255 : (uint8_t)value;
-            break;
-
-        case Setting_FanPort1:
-            fan_setting.port[1] = value < 0.0f ? 255 : (uint8_t)value;
-            break;
-
-        case Setting_FanPort2:
-            fan_setting.port[2] = value < 0.0f ? 255 : (uint8_t)value;
-            break;
-
-        case Setting_FanPort3:
-            fan_setting.port[2] = value < 0.0f ? 255 : (uint8_t)value;
-            break;
-
-        default:
-            break;
-    }
+        fan_setting.temp_port = value < 0.0f ? 0xFF : (uint8_t)value;
 
     return status;
 }
 
-static float get_float (setting_id_t setting)
+static float get_temp_port (setting_id_t setting)
 {
-    float value = 0.0f;
+    return fan_setting.temp_port >= n_aiports ? -1.0f : (float)fan_setting.temp_port;
+}
 
-    switch(setting) {
+// Per fan settings, expanded for each fan.
+#define FAN_SETTINGS(n) \
+    { FAN_PORT_SETTING_ID(n), Group_AuxPorts, "Fan " #n " port", NULL, Format_Decimal, "-#0", "-1", max_port, Setting_NonCoreFn, set_port, get_port, is_setting_available }, \
+    { FAN_SETTING_ID(n, FanSetting_PortType), Group_AuxPorts, "Fan " #n " port type", NULL, Format_RadioButtons, FAN_PORT_TYPES, NULL, NULL, Setting_NonCore, &fan_setting.fan[n].port_type, NULL, is_setting_available, { .reboot_required = On } }, \
+    { FAN_SETTING_ID(n, FanSetting_DutyMin), Group_AuxPorts, "Fan " #n " min duty", "%", Format_Int8, "##0", "0", "100", Setting_NonCore, &fan_setting.fan[n].duty_min, NULL, is_setting_available }, \
+    { FAN_SETTING_ID(n, FanSetting_DutyMax), Group_AuxPorts, "Fan " #n " max duty", "%", Format_Int8, "##0", "0", "100", Setting_NonCore, &fan_setting.fan[n].duty_max, NULL, is_setting_available }, \
+    { FAN_OFF_DELAY_SETTING_ID(n), Group_Coolant, "Fan " #n " off delay", "minutes", Format_Decimal, "#0.0", "0.0", "30.0", Setting_NonCore, &fan_setting.fan[n].off_delay, NULL, NULL }, \
+    { FAN_SETTING_ID(n, FanSetting_MinOnTime), Group_Coolant, "Fan " #n " min on time", "s", Format_Int16, "###0", "0", "3600", Setting_NonCore, &fan_setting.fan[n].min_on_time, NULL, NULL }, \
+    { FAN_SETTING_ID(n, FanSetting_TachPort), Group_AuxPorts, "Fan " #n " tach port", NULL, Format_Decimal, "-#0", "-1", max_iport, Setting_NonCoreFn, set_port, get_port, is_setting_available, { .reboot_required = On } }, \
+    { FAN_SETTING_ID(n, FanSetting_TachPPR), Group_AuxPorts, "Fan " #n " tach pulses", "pulses/rev", Format_Int8, "#0", "1", "16", Setting_NonCore, &fan_setting.fan[n].tach_ppr, NULL, is_setting_available }, \
+    { FAN_SETTING_ID(n, FanSetting_StallRpm), Group_Coolant, "Fan " #n " stall RPM", "RPM", Format_Int16, "####0", NULL, NULL, Setting_NonCore, &fan_setting.fan[n].stall_rpm, NULL, is_setting_available }, \
+    { FAN_SETTING_ID(n, FanSetting_StallGrace), Group_Coolant, "Fan " #n " stall grace period", "s", Format_Decimal, "#0.0", "0.0", "60.0", Setting_NonCore, &fan_setting.fan[n].stall_grace, NULL, is_setting_available },
+
+#if FANS_MODBUS
+// Modbus fan settings, expanded for each fan.
+#define FAN_MODBUS_SETTINGS(n) \
+    { FAN_EXT_SETTING_ID(n, FanSettingExt_ModbusAddress), Group_AuxPorts, "Fan " #n " Modbus address", NULL, Format_Int8, "##0", "1", "247", Setting_NonCore, &fan_setting.modbus[n].address, NULL, is_setting_available }, \
+    { FAN_EXT_SETTING_ID(n, FanSettingExt_ModbusRegister), Group_AuxPorts, "Fan " #n " Modbus speed register", NULL, Format_Int16, "####0", "0", "65535", Setting_NonCore, &fan_setting.modbus[n].reg, NULL, is_setting_available }, \
+    { FAN_EXT_SETTING_ID(n, FanSettingExt_ModbusMax), Group_AuxPorts, "Fan " #n " Modbus full speed value", NULL, Format_Int16, "####0", "1", "65535", Setting_NonCore, &fan_setting.modbus[n].max_value, NULL, is_setting_available },
+#else
+#define FAN_MODBUS_SETTINGS(n)
+#endif
 
-        case Setting_FanPort0:
-            value = fan_setting.port[0] >= n_ports ? -1.0f : (float)fan_setting.port[0];
-            break;
+// Extended per fan settings, expanded for each fan.
+#define FAN_EXT_SETTINGS(n) \
+    { FAN_EXT_SETTING_ID(n, FanSettingExt_Spindle), Group_Spindle, "Fan " #n " spindle", NULL, Format_Decimal, "-#0", "-1", max_spindle, Setting_NonCoreFn, set_spindle_bind, get_spindle_bind, is_setting_available }, \
+    { FAN_EXT_SETTING_ID(n, FanSettingExt_LinkSource), Group_Coolant, "Fan " #n " link sources", NULL, Format_Bitfield, "Coolant flood,Coolant mist,Program running", NULL, NULL, Setting_NonCore, &fan_setting.link_source[n], NULL, is_setting_available }, \
+    FAN_MODBUS_SETTINGS(n)
 
-        case Setting_FanPort1:
-            value = fan_setting.port[1] >= n_ports ? -1.0f : (float)fan_setting.port[1];
-            break;
+static const setting_detail_t fan_settings[] = {
+#if FANS_ENABLE == 1
+    { Setting_FanToSpindleLink, Group_Spindle, "Fan to spindle enable link", NULL, Format_Bool, NULL, NULL, NULL, Setting_NonCoreFn, set_spindle_link, get_spindle_link, NULL },
+#else
+    { Setting_FanToSpindleLink, Group_Spindle, "Fan to spindle enable link", NULL, Format_Bitfield, FANS_BITFIELD_FORMAT, NULL, NULL, Setting_NonCoreFn, set_spindle_link, get_spindle_link, NULL },
+#endif
+    FOR_EACH_FAN(FAN_SETTINGS)
+    { Setting_FanRpmLink, Group_Spindle, "Fan speed to spindle RPM link", NULL, Format_Bitfield, FANS_BITFIELD_FORMAT, NULL, NULL, Setting_NonCoreFn, set_rpm_link, get_rpm_link, is_setting_available },
+    { Setting_FanRpmMin, Group_Spindle, "Fan speed curve min RPM", "RPM", Format_Decimal, "#####0", NULL, NULL, Setting_NonCore, &fan_setting.rpm_min, NULL, is_setting_available },
+    { Setting_FanRpmMax, Group_Spindle, "Fan speed curve max RPM", "RPM", Format_Decimal, "#####0", NULL, NULL, Setting_NonCore, &fan_setting.rpm_max, NULL, is_setting_available },
+    { Setting_FanRpmBreakpoint, Group_Spindle, "Fan speed curve breakpoint RPM", "RPM", Format_Decimal, "#####0", NULL, NULL, Setting_NonCore, &fan_setting.rpm_breakpoint, NULL, is_setting_available },
+    { Setting_FanRpmBreakpointDuty, Group_Spindle, "Fan speed curve breakpoint duty", "%", Format_Int8, "##0", "0", "100", Setting_NonCore, &fan_setting.rpm_breakpoint_duty, NULL, is_setting_available },
+    { Setting_FanRpmHysteresis, Group_Spindle, "Fan speed curve hysteresis", "RPM", Format_Int16, "####0", NULL, NULL, Setting_NonCore, &fan_setting.rpm_hysteresis, NULL, is_setting_available },
+    { Setting_FanStallAction, Group_Coolant, "Fan stall action", NULL, Format_RadioButtons, "Warning,Feed hold,Alarm", NULL, NULL, Setting_NonCore, &fan_setting.stall_action, NULL, is_setting_available },
+    { Setting_FanTempLink, Group_Coolant, "Fan speed to temperature link", NULL, Format_Bitfield, FANS_BITFIELD_FORMAT, NULL, NULL, Setting_NonCoreFn, set_temp_link, get_temp_link, is_setting_available, { .reboot_required = On } },
+    { Setting_FanTempPort, Group_AuxPorts, "Fan temperature sensor port", NULL, Format_Decimal, "-#0", "-1", max_aiport, Setting_NonCoreFn, set_temp_port, get_temp_port, is_setting_available, { .reboot_required = On } },
+    { Setting_FanTempSetpoint, Group_Coolant, "Fan temperature setpoint", "deg", Format_Decimal, "##0.0", "0.0", "150.0", Setting_NonCore, &fan_setting.temp_setpoint, NULL, is_setting_available },
+    { Setting_FanTempKp, Group_Coolant, "Fan temperature P-gain", "%/deg", Format_Decimal, "##0.000", "0.0", "100.0", Setting_NonCore, &fan_setting.temp_kp, NULL, is_setting_available },
+    { Setting_FanTempKi, Group_Coolant, "Fan temperature I-gain", "%/(deg*s)", Format_Decimal, "##0.000", "0.0", "10.0", Setting_NonCore, &fan_setting.temp_ki, NULL, is_setting_available },
+    { Setting_FanTempKd, Group_Coolant, "Fan temperature D-gain", "%*s/deg", Format_Decimal, "##0.000", "0.0", "10.0", Setting_NonCore, &fan_setting.temp_kd, NULL, is_setting_available },
+    { Setting_FanStartStagger, Group_Coolant, "Fan start stagger", "ms", Format_Int16, "####0", "0", "10000", Setting_NonCore, &fan_setting.start_stagger, NULL, NULL },
+    { Setting_FanSoftStart, Group_Coolant, "Fan soft start time", "ms", Format_Int16, "####0", "0", "10000", Setting_NonCore, &fan_setting.soft_start, NULL, is_setting_available },
+    { Setting_FanCompactReport, Group_General, "Fan compact report", NULL, Format_Bool, NULL, NULL, NULL, Setting_NonCore, &fan_setting.compact_report, NULL, NULL },
+    { Setting_FanReportRate, Group_General, "Fan report rate limit", "Hz", Format_Int8, "##0", "0", "50", Setting_NonCore, &fan_setting.report_rate, NULL, NULL },
+    { Setting_FanPlannerSync, Group_Coolant, "Fan planner synchronized commands", NULL, Format_Bool, NULL, NULL, NULL, Setting_NonCore, &fan_setting.planner_sync, NULL, NULL },
+    { Setting_FanLeadTime, Group_Spindle, "Spindle linked fans lead time", "s", Format_Decimal, "#0.0", "0.0", "60.0", Setting_NonCore, &fan_setting.lead_time, NULL, NULL },
+    { Setting_FanAirAssistLink, Group_Spindle, "Fan to laser air assist link", NULL, Format_Bitfield, FANS_BITFIELD_FORMAT, NULL, NULL, Setting_NonCore, &fan_setting.air_assist_link, NULL, NULL },
+    FOR_EACH_FAN(FAN_EXT_SETTINGS)
+    { Setting_FanAirAssistHoldOff, Group_Spindle, "Fan air assist hold-off", "ms", Format_Int16, "####0", "0", "10000", Setting_NonCore, &fan_setting.air_assist_holdoff, NULL, NULL },
+    { Setting_FanStandbyLink, Group_Coolant, "Fan standby", NULL, Format_Bitfield, FANS_BITFIELD_FORMAT, NULL, NULL, Setting_NonCore, &fan_setting.standby_link, NULL, NULL },
+    { Setting_FanStandbyDelay, Group_Coolant, "Fan standby delay", "min", Format_Int16, "###0", "0", "1440", Setting_NonCore, &fan_setting.standby_delay, NULL, NULL },
+    { Setting_FanStandbyDuty, Group_Coolant, "Fan standby duty", "%", Format_Int8, "##0", "0", "100", Setting_NonCore, &fan_setting.standby_duty, NULL, NULL },
+};
 
-        case Setting_FanPort2:
-            value = fan_setting.port[2] >= n_ports ? -1.0f : (float)fan_setting.port[2];
-            break;
+#ifndef NO_SETTINGS_DESCRIPTIONS
 
-        case Setting_FanPort3:
-            value = fan_setting.port[3] >= n_ports ? -1.0f : (float)fan_setting.port[3];
-            break;
+#define FAN_SETTINGS_DESCR(n) \
+    { FAN_PORT_SETTING_ID(n), "Aux output port number to use for fan " #n " control. Set to -1 to disable." }, \
+    { FAN_SETTING_ID(n, FanSetting_PortType), "Aux output port type to use for fan " #n " control, analog ports are used for PWM speed control." }, \
+    { FAN_SETTING_ID(n, FanSetting_DutyMin), "Minimum duty for fan " #n ", non-zero M106 S-values are clamped to this." }, \
+    { FAN_SETTING_ID(n, FanSetting_DutyMax), "Maximum duty for fan " #n ", M106 S-values are clamped to this." }, \
+    { FAN_OFF_DELAY_SETTING_ID(n), "Delay before turning fan " #n " off after program end, or spindle stop if linked." }, \
+    { FAN_SETTING_ID(n, FanSetting_MinOnTime), "Minimum time fan " #n " is kept running before being automatically turned off." }, \
+    { FAN_SETTING_ID(n, FanSetting_TachPort), "Aux input port number to use for fan " #n " tachometer. Set to -1 to disable." }, \
+    { FAN_SETTING_ID(n, FanSetting_TachPPR), "Number of tachometer pulses per revolution for fan " #n ", most PC fans outputs 2." }, \
+    { FAN_SETTING_ID(n, FanSetting_StallRpm), "Fan " #n " is considered stalled when running below this speed. Set to 0 to disable stall detection." }, \
+    { FAN_SETTING_ID(n, FanSetting_StallGrace), "Time fan " #n " may run below the stall speed, including spin up, before the stall action is raised." },
+
+#if FANS_MODBUS
+#define FAN_MODBUS_SETTINGS_DESCR(n) \
+    { FAN_EXT_SETTING_ID(n, FanSettingExt_ModbusAddress), "Modbus slave address of fan " #n " controller." }, \
+    { FAN_EXT_SETTING_ID(n, FanSettingExt_ModbusRegister), "Holding register the speed of fan " #n " is written to, 0 is written when the fan is off." }, \
+    { FAN_EXT_SETTING_ID(n, FanSettingExt_ModbusMax), "Register value for fan " #n " full speed, speed is scaled from 0 to this value." },
+#else
+#define FAN_MODBUS_SETTINGS_DESCR(n)
+#endif
 
-        default:
-            break;
-    }
+#define FAN_EXT_SETTINGS_DESCR(n) \
+    { FAN_EXT_SETTING_ID(n, FanSettingExt_Spindle), "Spindle id fan " #n " is linked to, set to -1 to link to any spindle." }, \
+    { FAN_EXT_SETTING_ID(n, FanSettingExt_LinkSource), "Turn fan " #n " on when any of the selected sources are active, in addition to the spindle enable link. Turned off with the off delay when none are active." }, \
+    FAN_MODBUS_SETTINGS_DESCR(n)
 
-    return value;
-}
+static const setting_descr_t fan_settings_descr[] = {
+    { Setting_FanToSpindleLink, "Link fan enable signal to spindle enable, with optional off delay." },
+    FOR_EACH_FAN(FAN_SETTINGS_DESCR)
+    { Setting_FanRpmLink, "Let speed of spindle linked analog fans follow spindle RPM, from min duty at min RPM to max duty at max RPM." },
+    { Setting_FanRpmMin, "Spindle RPM at which the fan speed curve starts." },
+    { Setting_FanRpmMax, "Spindle RPM at which the fan speed curve reaches max duty." },
+    { Setting_FanRpmBreakpoint, "Optional spindle RPM for a breakpoint in the fan speed curve. Set to 0 for a linear curve." },
+    { Setting_FanRpmBreakpointDuty, "Fan speed at the breakpoint, in percent of the min to max duty range." },
+    { Setting_FanRpmHysteresis, "Minimum change in spindle RPM before fan speed is updated." },
+    { Setting_FanStallAction, "Action to take when a fan with a tachometer stalls. A warning is always reported." },
+    { Setting_FanTempLink, "Let speed of specific fans be controlled by temperature, such fans are turned off when the controller output is zero." },
+    { Setting_FanTempPort, "Aux analog input port number to use for the thermistor. Set to -1 to disable." },
+    { Setting_FanTempSetpoint, "Temperature the fans are controlled to keep, in degrees Celsius." },
+    { Setting_FanTempKp, "Proportional gain, fan speed increase in percent per degree above setpoint." },
+    { Setting_FanTempKi, "Integral gain, fan speed increase in percent per degree above setpoint per second." },
+    { Setting_FanTempKd, "Derivative gain, fan speed increase in percent per degree per second temperature rise." },
+    { Setting_FanStartStagger, "Delay between starting spindle linked fans, avoids inrush current from several fans starting at the same time." },
+    { Setting_FanSoftStart, "Time for ramping analog fans from zero to commanded speed on turn on. Set to 0 to disable." },
+    { Setting_FanCompactReport, "Report fan state, duty, speed and temperature as a fixed width hex element in the real time report, emitted on changes only." },
+    { Setting_FanReportRate, "Max rate of fan state changes in the real time report. Set to 0 for no limit." },
+    { Setting_FanPlannerSync, "Apply M106 and M107 when the next motion block starts executing instead of when parsed, without waiting for the planner buffer to empty." },
+    { Setting_FanLeadTime, "Time spindle linked fans are started ahead of the spindle, shared by all fans and spindles. Fans are started when the spindle on command is parsed and if any fan was started the program is paused, as for a G4 dwell, for the remainder before the spindle is started. Not in laser mode. Set to 0 to disable." },
+    { Setting_FanAirAssistLink, "In laser mode let fans follow the laser, on while firing with non-zero power and off during rapids. Such fans are not linked to spindle enable in laser mode." },
+    FOR_EACH_FAN(FAN_EXT_SETTINGS_DESCR)
+    { Setting_FanAirAssistHoldOff, "Time the laser has to be off before air assist fans are turned off, avoids switching between short vectors." },
+    { Setting_FanStandbyLink, "Fans to put in standby when the controller has been idle or sleeping for the standby delay. They are restored on cycle start." },
+    { Setting_FanStandbyDelay, "Time in idle or sleep state before fans enter standby. Set to 0 to disable." },
+    { Setting_FanStandbyDuty, "Speed of analog fans in standby, digital fans are turned off. Set to 0 to turn all standby fans off." },
+};
 
-static status_code_t set_spindle_link (setting_id_t setting, uint32_t value)
+#endif
+
+// Precompute runtime values derived from settings, keeps float math out of the spindle and program end paths.
+static void fan_settings_changed (settings_t *settings, settings_changed_flags_t changed)
 {
     uint_fast8_t idx = FANS_ENABLE;
 
-    fans.spindle_link = 0;
-    fan_setting.spindle_link = value;
+    do {
+        idx--;
+        fans[idx].duty_min = (fan_setting.fan[idx].duty_min * 255 + 50) / 100;
+        fans[idx].duty_max = (fan_setting.fan[idx].duty_max * 255 + 50) / 100;
+        fans[idx].off_delay = (uint32_t)(fan_setting.fan[idx].off_delay * 60.0f * 1000.0f);
+        fans[idx].min_on = (uint32_t)fan_setting.fan[idx].min_on_time * 1000;
+        fans[idx].stall_grace = (uint32_t)(fan_setting.fan[idx].stall_grace * 1000.0f);
+    } while(idx);
+
+    fan_rpm_curve_build();
+
+    air_fans = settings && settings->mode == Mode_Laser ? fan_setting.air_assist_link : 0;
+    standby_duty = (fan_setting.standby_duty * 255 + 50) / 100;
 
+    memset(link_fans, 0, sizeof(link_fans));
+
+    idx = FANS_ENABLE;
     do {
-        if(bit_istrue(fan_setting.spindle_link, bit(--idx)) && fans.port[idx] != 0xFF)
-            bit_true(fans.spindle_link, bit(idx));
+        uint_fast8_t src = FanLink_N;
+        idx--;
+        do {
+            if(fan_setting.link_source[idx] & bit(--src))
+                bit_true(link_fans[src], bit(idx));
+        } while(src);
     } while(idx);
 
-    return Status_OK;
+    // Gains in percent are converted to 0 - 255 output level per 0.1 degC and control period.
+    ramp_step = fan_setting.soft_start ? (fan_setting.soft_start <= FAN_TICK_PERIOD ? 255 : (255 * FAN_TICK_PERIOD + fan_setting.soft_start - 1) / fan_setting.soft_start) : 0;
+
+    temp_ctrl.setpoint = (int16_t)lroundf(fan_setting.temp_setpoint * 10.0f);
+    temp_ctrl.kp = (int32_t)(fan_setting.temp_kp * (2.55f / 10.0f) * (float)(1 << FAN_PID_SHIFT));
+    temp_ctrl.ki = (int32_t)(fan_setting.temp_ki * (2.55f / 10.0f) * ((float)FAN_TICK_PERIOD / 1000.0f) * (float)(1 << FAN_PID_SHIFT));
+    temp_ctrl.kd = (int32_t)(fan_setting.temp_kd * (2.55f / 10.0f) * (1000.0f / (float)FAN_TICK_PERIOD) * (float)(1 << FAN_PID_SHIFT));
 }
 
-static uint32_t get_spindle_link (setting_id_t setting)
+// Write settings to non volatile storage (NVS).
+static void fan_settings_write (void)
 {
-    return fan_setting.spindle_link;
+    settings_dirty = false;
+    fan_setting.version = FAN_SETTINGS_VERSION;
+    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&fan_setting, sizeof(fan_settings_t), true);
 }
 
-static const setting_detail_t fan_settings[] = {
-    { Setting_Fan0OffDelay, Group_Coolant, "Fan 0 off delay", "minutes", Format_Decimal, "#0.0", "0.0", "30.0", Setting_NonCore, &fan_setting.fan0_off_delay, NULL, NULL },
-    { Setting_FanPort0, Group_AuxPorts, "Fan 0 port", NULL, Format_Decimal, "-#0", "-1", max_port, Setting_NonCoreFn, set_float, get_float, is_setting_available, { .reboot_required = On } },
-#if FANS_ENABLE == 1
-    { Setting_FanToSpindleLink, Group_Spindle, "Fan to spindle enable link", NULL, Format_Bool, NULL, NULL, NULL, Setting_NonCoreFn, set_spindle_link, get_spindle_link, NULL },
-#endif
-#if FANS_ENABLE > 1
-    { Setting_FanPort1, Group_AuxPorts, "Fan 1 port", NULL, Format_Decimal, "-#0", "-1", max_port, Setting_NonCoreFn, set_float, get_float, is_setting_available, { .reboot_required = On } },
-#endif
-#if FANS_ENABLE == 2
-    { Setting_FanToSpindleLink, Group_Spindle, "Fan to spindle enable link", NULL, Format_Bitfield, "Fan 0,Fan 1", NULL, NULL, Setting_NonCoreFn, set_spindle_link, get_spindle_link, NULL },
-#endif
-#if FANS_ENABLE > 2
-    { Setting_FanPort2, Group_AuxPorts, "Fan 2 port", NULL, Format_Decimal, "-#0", "-1", max_port, Setting_NonCoreFn, set_float, get_float, is_setting_available, { .reboot_required = On } },
-#endif
-#if FANS_ENABLE == 3
-    { Setting_FanToSpindleLink, Group_Spindle, "Fan to spindle enable link", NULL, Format_Bitfield, "Fan 0,Fan 1,Fan 2", NULL, NULL, Setting_NonCoreFn, set_spindle_link, get_spindle_link, NULL },
-#endif
-#if FANS_ENABLE > 3
-    { Setting_FanPort3, Group_AuxPorts, "Fan 3 port", NULL, Format_Decimal, "-#0", "-1", max_port, Setting_NonCoreFn, set_float, get_float, is_setting_available, { .reboot_required = On } },
-#endif
-#if FANS_ENABLE == 4
-    { Setting_FanToSpindleLink, Group_Spindle, "Fan to spindle enable link", NULL, Format_Bitfield, "Fan 0,Fan 1,Fan 2,Fan 3", NULL, NULL, Setting_NonCoreFn, set_spindle_link, get_spindle_link, NULL },
-#endif
-};
-
-#ifndef NO_SETTINGS_DESCRIPTIONS
+// Delayed write of changed settings, postponed while a motion is in progress.
+static void fan_settings_flush (void *data)
+{
+    if(!((state_get() & (STATE_CYCLE|STATE_HOLD|STATE_JOG|STATE_HOMING)) &&
+          task_add_delayed(fan_settings_flush, NULL, FAN_SETTINGS_FLUSH_DELAY)))
+        fan_settings_write();
+}
 
-static const setting_descr_t fan_settings_descr[] = {
-    { Setting_Fan0OffDelay, "Delay before turning fan 0 off after program end." },
-    { Setting_FanPort0, "Aux output port number to use for fan 0 control. Set to -1 to disable." },
-    { Setting_FanToSpindleLink, "Link fan enable signal to spindle enable, fan 0 with optional off delay." },
-#if FANS_ENABLE > 1
-    { Setting_FanPort1, "Aux output port number to use for fan 1 control. Set to -1 to disable." },
-#endif
-#if FANS_ENABLE > 2
-    { Setting_FanPort2, "Aux output port number to use for fan 2 control. Set to -1 to disable." },
-#endif
-#if FANS_ENABLE > 3
-    { Setting_FanPort3, "Aux output port number to use for fan 3 control. Set to -1 to disable." },
-#endif
-};
+// Settings changes are coalesced, the NVS block is written when no changes has been made for FAN_SETTINGS_FLUSH_DELAY ms,
+// or on program completion, whichever comes first.
+static void fan_settings_save (void)
+{
+#if FAN_SETTINGS_FLUSH_DELAY
+    if(settings_dirty)
+        task_delete(fan_settings_flush, NULL);
 
+    if(!(settings_dirty = task_add_delayed(fan_settings_flush, NULL, FAN_SETTINGS_FLUSH_DELAY)))
 #endif
+    fan_settings_write();
+}
 
-// Write settings to non volatile storage (NVS).
-static void fan_settings_save (void)
+// Set defaults for settings added after the stored version.
+static void fan_settings_migrate (uint8_t version)
 {
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&fan_setting, sizeof(fan_settings_t), true);
+    if(version < 2) {
+        fan_setting.air_assist_link = 0;
+        fan_setting.air_assist_holdoff = 500;
+    }
+
+    if(version < 3)
+        memset(fan_setting.link_source, 0, sizeof(fan_setting.link_source));
+
+    if(version < 4) {
+        fan_setting.standby_link = 0;
+        fan_setting.standby_duty = 0;
+        fan_setting.standby_delay = 0;
+    }
+
+    if(version < 5) {
+        uint_fast8_t idx = FANS_ENABLE;
+        do {
+            fan_setting.modbus[--idx].address = 1;
+            fan_setting.modbus[idx].reg = 0;
+            fan_setting.modbus[idx].max_value = 10000;
+        } while(idx);
+    }
+
+    fan_settings_write();
 }
 
 // Restore default settings and write to non volatile storage (NVS).
 // Default is highest numbered free port.
 static void fan_settings_restore (void)
 {
+    uint_fast8_t idx = FANS_ENABLE;
+
+    if(settings_dirty) {
+        task_delete(fan_settings_flush, NULL);
+        settings_dirty = false;
+    }
+
+    memset(&fan_setting, 0, sizeof(fan_settings_t));
+
     fan_setting.spindle_link = 0;
-    fan_setting.fan0_off_delay = 0.0f;
+    fan_setting.rpm_link = 0;
+    fan_setting.rpm_min = 0.0f;
+    fan_setting.rpm_max = DEFAULT_SPINDLE_RPM_MAX;
+    fan_setting.rpm_breakpoint = 0.0f;
+    fan_setting.rpm_breakpoint_duty = 50;
+    fan_setting.rpm_hysteresis = 100;
+    fan_setting.stall_action = FanStall_Warning;
+    fan_setting.temp_link = 0;
+    fan_setting.compact_report = Off;
+    fan_setting.report_rate = 0;
+    fan_setting.planner_sync = Off;
+    fan_setting.start_stagger = 0;
+    fan_setting.lead_time = 0.0f;
+    fan_setting.soft_start = 0;
+    fan_setting.temp_port = 0xFF;
+    fan_setting.temp_setpoint = 40.0f;
+    fan_setting.temp_kp = 10.0f;
+    fan_setting.temp_ki = 0.5f;
+    fan_setting.temp_kd = 0.0f;
+    fan_setting.air_assist_link = 0;
+    fan_setting.air_assist_holdoff = 500;
 
-    if(n_ports) {
-        uint32_t idx = FANS_ENABLE;
-        uint8_t base_port = n_ports - FANS_ENABLE;
+    do {
+        fan_setting.fan[--idx].port_type = FanPort_Digital;
+        fan_setting.fan[idx].duty_min = 0;
+        fan_setting.fan[idx].duty_max = 100;
+        fan_setting.fan[idx].tach_port = 0xFF;
+        fan_setting.fan[idx].tach_ppr = 2;
+        fan_setting.fan[idx].spindle = 0xFF;
+        fan_setting.fan[idx].stall_rpm = 0;
+        fan_setting.fan[idx].stall_grace = 5.0f;
+        fan_setting.fan[idx].min_on_time = 0;
+        fan_setting.fan[idx].off_delay = 0.0f;
+        fan_setting.modbus[idx].address = 1;
+        fan_setting.modbus[idx].reg = 0;
+        fan_setting.modbus[idx].max_value = 10000;
+    } while(idx);
 
-        do {
-            if(--idx != 0 || fan_spindle_set_state == NULL)
-                fan_setting.port[idx] = base_port + idx;
-        } while(idx);
-    }
+    // Default to the highest numbered free digital ports, in ascending order so that fan 0 gets the lowest.
+    uint_fast8_t port = n_ports, n_free_ports = n_free[0] < FANS_ENABLE ? n_free[0] : FANS_ENABLE;
 
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&fan_setting, sizeof(fan_settings_t), true);
+    idx = FANS_ENABLE;
+    do {
+        fan_setting.fan[--idx].port = 0xFF;
+        if(idx < n_free_ports) {
+            while(!fan_port_free(false, --port));
+            fan_setting.fan[idx].port = port;
+        }
+    } while(idx);
+
+    fan_settings_write();
 }
 
 static void fan_settings_load (void)
 {
-    uint_fast8_t failed = 0;
+    int8_t spindle_id = 0;
+    uint_fast8_t idx = FANS_ENABLE, failed = 0;
 
-    spindle_enumerate_spindles(spindle_enumerate, NULL);
+    spindle_enumerate_spindles(spindle_enumerate, &spindle_id);
+    strcpy(max_spindle, uitoa(spindle_id));
 
-    if(hal.nvs.memcpy_from_nvs((uint8_t *)&fan_setting, nvs_address, sizeof(fan_settings_t), true) != NVS_TransferResult_OK)
+    if(hal.nvs.memcpy_from_nvs((uint8_t *)&fan_setting, nvs_address, sizeof(fan_settings_t), true) != NVS_TransferResult_OK ||
+        fan_setting.version == 0 || fan_setting.version > FAN_SETTINGS_VERSION)
         fan_settings_restore();
+    else if(fan_setting.version < FAN_SETTINGS_VERSION)
+        fan_settings_migrate(fan_setting.version);
 
-    if(n_ports)  {
+    // Ports can only be claimed once, on a settings reload the fans are turned off and the claimed ports kept.
+    if(ports_loaded)
+        fans_set_mask(FANS_ALL, 0);
 
-        uint_fast8_t idx = FANS_ENABLE;
+    do {
+        fan_t *fan = &fans[--idx];
+
+        fan->duty = 255;
+        fan->rpm = 0;
+        fan->stall_at = 0;
+        fan->off_at = fan->start_at = 0;
+        fan->ramp = 0;
+        fan->reported = fan->notified = 0;
+        fan->override = 100;
+
+        // On reload a changed port is moved to, a Modbus fan keeps its backend and gets the reloaded address.
+        if(ports_loaded) {
+            fan->flags.value &= ((fan_flags_t){ .analog = On, .tach = On }).value;
+#if FANS_MODBUS
+            if(fan->output == fan_output_modbus) {
+                if(fan_setting.fan[idx].port_type == FanPort_Modbus)
+                    fan->port = fan_setting.modbus[idx].address;
+                else
+                    failed++;
+            } else
+#endif
+            if(fan_setting.fan[idx].port_type == FanPort_Modbus ||
+                 (fan_setting.fan[idx].port != fan->setting_port && !fan_port_reassign(idx, fan_setting.fan[idx].port)))
+                failed++;
+            continue;
+        }
 
-        fans.spindle_link = fan_setting.spindle_link;
+        fan->port = fan->setting_port = 0xFF;
+        fan->tach_port = 0xFF;
+        fan->flags.value = 0;
+        fan->output = fan_output_aux_digital;
+
+        if(fan_setting.fan[idx].port_type == FanPort_Modbus) {
+#if FANS_MODBUS
+            if(modbus_isup() && (fan->port = fan_setting.modbus[idx].address) != 0xFF) {
+                fan->flags.analog = On;
+                fan->output = fan_output_modbus;
+            } else
+#endif
+                failed++;
+        } else if(n_ports || n_aports) {
+
+            bool analog = fan_setting.fan[idx].port_type == FanPort_Analog;
+
+            // Sanity check
+            if(fan_setting.fan[idx].port != 0xFF && !fan_port_free(analog, fan_setting.fan[idx].port))
+                fan_setting.fan[idx].port = 0xFF;
+
+            if((fan->port = fan_setting.fan[idx].port) != 0xFF && ioport_claim(analog ? Port_Analog : Port_Digital, Port_Output, &fan->port, fan_names[idx])) {
+                fan->setting_port = fan_setting.fan[idx].port;
+                fan->flags.analog = analog;
+                fan->output = analog ? fan_output_aux_analog : fan_output_aux_digital;
+            } else {
+                failed++;
+                fan->port = 0xFF;
+            }
 
-        do {
-            if(--idx != 0 || fan_spindle_set_state == NULL) {
-                // Sanity check
-                if(fan_setting.port[idx] >= n_ports)
-                    fan_setting.port[idx] = 0xFF;
-
-                if((fans.port[idx] = fan_setting.port[idx]) != 0xFF && ioport_claim(Port_Digital, Port_Output, &fans.port[idx], fan_names[idx]))
-                    n_fans++;
-                else {
+            if(fan_setting.fan[idx].tach_port >= n_iports || fan_setting.fan[idx].tach_ppr == 0)
+                fan_setting.fan[idx].tach_port = 0xFF;
+
+            if(fan->port != 0xFF && (fan->tach_port = fan_setting.fan[idx].tach_port) != 0xFF) {
+                if(hal.port.register_interrupt_handler &&
+                    ioport_claim(Port_Digital, Port_Input, &fan->tach_port, fan_tach_names[idx]) &&
+                     hal.port.register_interrupt_handler(fan->tach_port, IRQ_Mode_Falling, fan_tach_isr[idx])) {
+                    fan->flags.tach = On;
+                    fan->tach_last = tach_count[idx];
+                } else {
                     failed++;
-                    fans.port[idx] = 0xFF;
-                    fans.spindle_link &= ~(1 << idx);
+                    fan->tach_port = 0xFF;
                 }
             }
-        } while(idx);
+        }
+    } while(idx);
+
+    n_fans = 0;
+    idx = FANS_ENABLE;
+    do {
+        if(fans[--idx].port != 0xFF)
+            n_fans++;
+    } while(idx);
+
+    if(ports_loaded) {
+        if(temp_ctrl.port != 0xFF)
+            fan_temp_lut_build();
+    } else {
+
+        if(fan_setting.temp_port >= n_aiports || hal.port.wait_on_input == NULL)
+            fan_setting.temp_port = 0xFF;
+
+        if((temp_ctrl.port = fan_setting.temp_port) != 0xFF && fan_setting.temp_link) {
+            if(ioport_claim(Port_Analog, Port_Input, &temp_ctrl.port, "Fan temperature")) {
+                fan_temp_lut_build();
+                temp_ctrl.temp = fan_temp_from_adc(hal.port.wait_on_input(Port_Analog, temp_ctrl.port, WaitMode_Immediate, 0.0f));
+            } else {
+                failed++;
+                temp_ctrl.port = 0xFF;
+            }
+        } else
+            temp_ctrl.port = 0xFF;
+    }
+
+    set_spindle_link(Setting_FanToSpindleLink, fan_setting.spindle_link);
+    set_rpm_link(Setting_FanRpmLink, fan_setting.rpm_link);
+    set_temp_link(Setting_FanTempLink, fan_setting.temp_link);
+    fan_settings_changed(&settings, (settings_changed_flags_t){0});
+
+    if(nvs_stats && hal.nvs.memcpy_from_nvs((uint8_t *)&fan_stats, nvs_stats, sizeof(fan_stats_t), true) != NVS_TransferResult_OK) {
+        memset(&fan_stats, 0, sizeof(fan_stats_t));
+        stats_unsaved = 1;
+        fan_stats_save();
     }
 
     if(n_fans)
         fan_setup();
 
+    ports_loaded = true;
+
     if(failed)
         protocol_enqueue_foreground_task(report_warning, "Fans plugin: configured port number(s) not available");
 }
@@ -491,9 +2863,12 @@ static void onReportOptions (bool newopt)
     on_report_options(newopt);
 
     if(!newopt) {
-        report_plugin("Fans", "0.15");
+        report_plugin("Fans", "0.30");
         hal.stream.write("[FANS:");
         hal.stream.write(uitoa(n_fans));
+#if FANS_PROFILE
+        hal.stream.write("|PROFILE");
+#endif
         hal.stream.write("]" ASCII_EOL);
     }
 }
@@ -507,15 +2882,31 @@ void fans_init (void)
         .descriptions = fan_settings_descr,
         .n_descriptions = sizeof(fan_settings_descr) / sizeof(setting_descr_t),
     #endif
+        .on_changed = fan_settings_changed,
         .save = fan_settings_save,
         .load = fan_settings_load,
         .restore = fan_settings_restore
     };
 
     if(ioport_can_claim_explicit() &&
-       (n_ports = ioports_available(Port_Digital, Port_Input)) &&
+       ((n_ports = ioports_available(Port_Digital, Port_Output)) | (n_aports = ioports_available(Port_Analog, Port_Output)) | FANS_MODBUS) &&
         (nvs_address = nvs_alloc(sizeof(fan_settings_t)))) {
 
+        fan_ports_scan();
+
+        if((n_iports = ioports_available(Port_Digital, Port_Input)))
+            strcpy(max_iport, uitoa(n_iports - 1));
+
+        if((n_aiports = ioports_available(Port_Analog, Port_Input)))
+            strcpy(max_aiport, uitoa(n_aiports - 1));
+
+        nvs_stats = nvs_alloc(sizeof(fan_stats_t));
+
+#if FANS_PROFILE && defined(DWT) && defined(CoreDebug)
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+
         settings_register(&setting_details);
 
         on_report_options = grbl.on_report_options;
@@ -23,8 +23,43 @@
 
 #pragma once
 
+// Driver function for writing several digital aux outputs at once, ports is a bitmask of ports to write
+// and value the corresponding output states.
+typedef void (*fans_digital_out_mask_ptr)(uint32_t ports, uint32_t value);
+
+#define FANS_MAX 8 // Max number of fans, size of the per fan arrays in fans_state_t
+
+// Snapshot of all fans, see fans_get_all().
+typedef struct {
+    uint8_t n_fans;             // Number of fans enabled
+    uint8_t available;          // Bitmask of fans with an output port
+    uint8_t on;                 // Bitmask of fans that are on
+    uint8_t analog;             // Bitmask of fans with speed control
+    uint8_t stalled;            // Bitmask of stalled fans
+    uint8_t duty[FANS_MAX];     // Commanded duty, 0 - 255
+    uint8_t output[FANS_MAX];   // Output duty after override and min/max clamping, 0 when off
+    uint8_t override[FANS_MAX]; // Duty override, percent
+    uint16_t rpm[FANS_MAX];     // Measured speed, 0 if no tachometer
+    int16_t temperature;        // Temperature controller input in 0.1 degC, INT16_MIN if not available
+} fans_state_t;
+
+// Called when the on/off state, output duty or stall status of fans changes, changed is a bitmask of the changed fans.
+typedef void (*on_fan_changed_ptr)(uint32_t changed);
+
+// Event handlers, to subscribe save the current pointer and call it from the new handler as for the core grbl.on_* events.
+typedef struct {
+    on_fan_changed_ptr on_fan_changed;
+} fans_events_t;
+
 void fans_init (void);
 bool fan_get_state (uint8_t fan);
 void fan_set_state (uint8_t fan, bool on);
+void fan_set_duty (uint8_t fan, uint8_t duty);
+void fans_set_mask (uint32_t mask, uint32_t value);
+void fans_set_duty (uint32_t mask, uint8_t duty);
+uint16_t fan_get_rpm (uint8_t fan);
+void fans_get_all (fans_state_t *state);
+fans_events_t *fans_get_events (void);
+void fans_register_digital_out_mask (fans_digital_out_mask_ptr fn);
 
 /*EOF*/
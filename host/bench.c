@@ -0,0 +1,430 @@
+/*
+
+  bench.c - replays spindle, fan and report traces against the fans plugin and measures the hot paths
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  grblHAL General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/*
+  Trace files has one event per line, prefixed by the time in milliseconds since the start of the trace:
+
+    <ms> $<id>=<value>   plugin setting, not timed
+    <ms> M3 S<rpm>       spindle on CW, M4 for CCW. The spindle programmed event is raised before the spindle is started
+    <ms> S<rpm>          spindle RPM change
+    <ms> M5              spindle off
+    <ms> M106 P<fan> S<duty>    fan on via the M-code handlers, P- and S-words are optional
+    <ms> M107 P<fan>     fan off via the M-code handlers
+    <ms> MASK <mask> <value>    fans_set_mask() call
+    <ms> M7, M8 or M9    coolant mist, flood or off
+    <ms> ?               realtime report
+    <ms> CYCLE, HOLD, TOOL_CHANGE or IDLE    state change
+    <ms> ADC <port>=<value>    set analog input reading, 12 bit
+    <ms> LOAD            reload stored settings, as done by the core after settings are restored
+    <ms> EXPECT D=<hex>  check digital output states, bit per port
+    <ms> EXPECT A<port>=<value>    check analog output value
+    <ms> EXPECT M<address>=<value> check the last register value written to a Modbus slave
+
+  Everything after a # is a comment. Settings before the first event are boot settings, they are stored before
+  the plugin loads its settings so port assignments and other settings requiring a reboot can be made.
+  Time between events is simulated, delayed tasks and the realtime handler runs once per millisecond.
+  The trace is loaded once and replayed the requested number of passes, event times are relative to the start
+  of each pass. Expectations are checked on every pass, the exit code is 1 if any fails or a setting is rejected.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_TIMER() __rdtsc()
+#define BENCH_UNIT "cycles"
+#else
+static inline uint64_t bench_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#define BENCH_TIMER() bench_ns()
+#define BENCH_UNIT "ns"
+#endif
+
+#include "mock.h"
+#include "fans.h"
+
+typedef enum {
+    Bench_SpindleSetState = 0,
+    Bench_SetMask,
+    Bench_MCode,
+    Bench_RealtimeReport,
+    Bench_N
+} bench_id_t;
+
+typedef struct {
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint32_t calls;
+} bench_stat_t;
+
+static const char *const bench_name[Bench_N] = { "onSpindleSetState", "fans_set_mask", "M106/M107", "onRealtimeReport" };
+static bench_stat_t stats[Bench_N];
+
+#define BENCH(id, call) { uint64_t t = BENCH_TIMER(); call; bench_record(id, BENCH_TIMER() - t); }
+
+static void bench_record (bench_id_t id, uint64_t t)
+{
+    bench_stat_t *stat = &stats[id];
+
+    if(stat->calls == 0 || t < stat->min)
+        stat->min = t;
+    if(t > stat->max)
+        stat->max = t;
+    stat->sum += t;
+    stat->calls++;
+}
+
+#define TRACE_MAX 1024
+
+typedef struct {
+    uint32_t at;
+    uint32_t line;
+    char cmd[40];
+} trace_event_t;
+
+static trace_event_t trace[TRACE_MAX];
+static uint32_t trace_length = 0, trace_boot = 0, failed = 0;
+static const char *trace_path;
+static spindle_state_t spindle_state = {0};
+static float spindle_rpm = 0.0f;
+
+static void spindle_set (bool on, bool ccw, float rpm)
+{
+    spindle_state_t state = {0};
+
+    state.on = on;
+    state.ccw = on && ccw;
+    spindle_rpm = rpm;
+
+    if(state.value != spindle_state.value && grbl.on_spindle_programmed)
+        grbl.on_spindle_programmed(&mock_spindle, state, rpm, SpindleSpeedMode_RPM);
+
+    spindle_state = state;
+
+    BENCH(Bench_SpindleSetState, mock_spindle.set_state(&mock_spindle, state, rpm));
+}
+
+static float word_value (const char *line, char letter, float dflt)
+{
+    const char *s = strchr(line, letter);
+
+    return s ? strtof(s + 1, NULL) : dflt;
+}
+
+// M106/M107 through the user M-code handlers as called by the parser.
+static void mcode (char *cmd)
+{
+    parser_block_t block = {0};
+
+    block.user_mcode = cmd[3] == '6' ? Fan_On : Fan_Off;
+    if((block.words.p = !!strchr(cmd, 'P')))
+        block.values.p = word_value(cmd, 'P', 0.0f);
+    if((block.words.q = !!strchr(cmd, 'Q')))
+        block.values.q = word_value(cmd, 'Q', 0.0f);
+    if((block.words.s = !!strchr(cmd, 'S')))
+        block.values.s = word_value(cmd, 'S', 0.0f);
+
+    if(grbl.user_mcode.check(block.user_mcode) == UserMCode_Unsupported || grbl.user_mcode.validate(&block) != Status_OK) {
+        fprintf(stderr, "%s: %s rejected\n", trace_path, cmd);
+        failed++;
+    } else if(block.words.mask) {
+        fprintf(stderr, "%s: %s has unused words\n", trace_path, cmd);
+        failed++;
+    } else
+        BENCH(Bench_MCode, grbl.user_mcode.execute(state_get(), &block));
+}
+
+// Checks an EXPECT event, returns false on syntax errors.
+static bool expect (const trace_event_t *event)
+{
+    const char *arg = event->cmd + 7;
+    char *end;
+
+    if(!strncmp(arg, "D=", 2)) {
+
+        uint32_t value = strtoul(arg + 2, &end, 16);
+
+        if(*end)
+            return false;
+
+        if(mock.digital != value) {
+            fprintf(stderr, "%s:%u: expected digital outputs %X, got %X\n", trace_path, event->line, (unsigned)value, (unsigned)mock.digital);
+            failed++;
+        }
+
+    } else if(*arg == 'A') {
+
+        uint32_t port = strtoul(arg + 1, &end, 10);
+        float value;
+
+        if(*end != '=' || port >= MOCK_ANALOG_OUT)
+            return false;
+
+        value = strtof(end + 1, &end);
+
+        if(*end)
+            return false;
+
+        if(fabsf(mock.analog[port] - value) > 0.5f) {
+            fprintf(stderr, "%s:%u: expected analog output %u %.1f, got %.1f\n", trace_path, event->line, (unsigned)port, value, mock.analog[port]);
+            failed++;
+        }
+
+    } else if(*arg == 'M') {
+
+        uint32_t address = strtoul(arg + 1, &end, 10), value;
+
+        if(*end != '=' || address >= MOCK_MODBUS_SLAVES)
+            return false;
+
+        value = strtoul(end + 1, &end, 10);
+
+        if(*end)
+            return false;
+
+        if(mock.modbus[address] != value) {
+            fprintf(stderr, "%s:%u: expected Modbus slave %u value %u, got %u\n", trace_path, event->line, (unsigned)address, (unsigned)value, (unsigned)mock.modbus[address]);
+            failed++;
+        }
+
+    } else
+        return false;
+
+    return true;
+}
+
+// Executes one trace event, returns false on syntax errors.
+static bool trace_event (const trace_event_t *event)
+{
+    const char *cmd = event->cmd;
+
+    if(*cmd == '$') {
+
+        char *eq = strchr(cmd, '=');
+
+        if(eq == NULL)
+            return false;
+
+        if(mock_setting_set((setting_id_t)atoi(cmd + 1), strtof(eq + 1, NULL), false) != Status_OK) {
+            fprintf(stderr, "%s:%u: setting %s rejected\n", trace_path, event->line, cmd);
+            failed++;
+        }
+
+    } else if(*cmd == '?') {
+
+        // Report tracking as done by the core, flags requested by the plugin are passed with the next report.
+        report_tracking_flags_t report = sys.report;
+
+        sys.report.value = 0;
+
+        BENCH(Bench_RealtimeReport, grbl.on_realtime_report(mock_report_write, report));
+        if(mock.verbose)
+            putchar('\n');
+
+    } else if(!strncmp(cmd, "EXPECT ", 7))
+        return expect(event);
+    else if(!strncmp(cmd, "M106", 4) || !strncmp(cmd, "M107", 4))
+        mcode((char *)cmd);
+    else if(!strncmp(cmd, "MASK ", 5)) {
+
+        char *end;
+        uint32_t mask = strtoul(cmd + 5, &end, 0), value = strtoul(end, NULL, 0);
+
+        BENCH(Bench_SetMask, fans_set_mask(mask, value));
+
+    } else if(!strncmp(cmd, "M3", 2) || !strncmp(cmd, "M4", 2))
+        spindle_set(true, cmd[1] == '4', word_value(cmd, 'S', spindle_rpm));
+    else if(!strncmp(cmd, "M5", 2))
+        spindle_set(false, false, spindle_rpm);
+    else if(*cmd == 'S') {
+        if(spindle_state.on)
+            spindle_set(true, spindle_state.ccw, strtof(cmd + 1, NULL));
+        else
+            spindle_rpm = strtof(cmd + 1, NULL);
+    } else if(cmd[0] == 'M' && cmd[1] >= '7' && cmd[1] <= '9') {
+        if(hal.coolant.set_state)
+            hal.coolant.set_state((coolant_state_t){ .mist = cmd[1] == '7', .flood = cmd[1] == '8' });
+    } else if(!strcmp(cmd, "CYCLE"))
+        mock_set_state(STATE_CYCLE);
+    else if(!strcmp(cmd, "HOLD"))
+        mock_set_state(STATE_HOLD);
+    else if(!strcmp(cmd, "TOOL_CHANGE"))
+        mock_set_state(STATE_TOOL_CHANGE);
+    else if(!strcmp(cmd, "IDLE"))
+        mock_set_state(STATE_IDLE);
+    else if(!strcmp(cmd, "LOAD"))
+        mock_settings_load();
+    else if(!strncmp(cmd, "ADC ", 4)) {
+
+        char *end;
+        uint32_t port = strtoul(cmd + 4, &end, 10);
+
+        if(*end != '=' || port >= MOCK_ANALOG_IN)
+            return false;
+
+        mock.adc[port] = strtol(end + 1, NULL, 10);
+
+    } else
+        return false;
+
+    return true;
+}
+
+// Loads trace into memory, the leading boot settings are counted by trace_boot.
+static bool trace_load (const char *path)
+{
+    FILE *file;
+    char line[128], *cmd, *end;
+    uint32_t line_no = 0;
+    bool ok = true;
+
+    if((file = fopen(path, "r")) == NULL) {
+        perror(path);
+        return false;
+    }
+
+    while(ok && fgets(line, sizeof(line), file)) {
+
+        line_no++;
+
+        if((end = strchr(line, '#')) || (end = strchr(line, '\n')))
+            *end = '\0';
+
+        uint32_t at = strtoul(line, &cmd, 10);
+
+        while(*cmd == ' ' || *cmd == '\t')
+            cmd++;
+
+        for(end = cmd + strlen(cmd); end > cmd && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'); *--end = '\0');
+
+        if(*cmd == '\0')
+            continue;
+
+        if(trace_length == TRACE_MAX || strlen(cmd) >= sizeof(trace[0].cmd)) {
+            fprintf(stderr, "%s:%u: trace too long\n", path, line_no);
+            ok = false;
+        } else {
+            trace[trace_length].at = at;
+            trace[trace_length].line = line_no;
+            strcpy(trace[trace_length].cmd, cmd);
+            if(*cmd == '$' && trace_boot == trace_length)
+                trace_boot++;
+            trace_length++;
+        }
+    }
+
+    fclose(file);
+
+    return ok;
+}
+
+// Replays the trace events following the boot settings.
+static bool trace_replay (void)
+{
+    uint32_t idx, start = mock.ms;
+
+    for(idx = trace_boot; idx < trace_length; idx++) {
+
+        if(start + trace[idx].at > mock.ms)
+            mock_run(start + trace[idx].at - mock.ms);
+
+        if(!trace_event(&trace[idx])) {
+            fprintf(stderr, "%s:%u: unknown event \"%s\"\n", trace_path, trace[idx].line, trace[idx].cmd);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main (int argc, char **argv)
+{
+    int arg, passes = 100, pass;
+    uint32_t idx;
+    bench_id_t id;
+
+    for(arg = 1; arg < argc && argv[arg][0] == '-'; arg++) {
+        if(!strcmp(argv[arg], "-v"))
+            mock.verbose = true;
+        else if(!strcmp(argv[arg], "-n") && arg + 1 < argc)
+            passes = atoi(argv[++arg]);
+        else
+            break;
+    }
+
+    if(arg != argc - 1 || passes < 1) {
+        fprintf(stderr, "usage: %s [-v] [-n passes] trace\n", argv[0]);
+        return 2;
+    }
+
+    if(!trace_load(trace_path = argv[arg]))
+        return 1;
+
+    mock_init();
+    fans_init();
+
+    // Boot: store the boot settings on top of the defaults, then load them as on a restart.
+    mock_settings_restore();
+    for(idx = 0; idx < trace_boot; idx++) {
+        char *eq = strchr(trace[idx].cmd, '=');
+        if(eq == NULL || mock_setting_set((setting_id_t)atoi(trace[idx].cmd + 1), strtof(eq + 1, NULL), true) != Status_OK) {
+            fprintf(stderr, "%s:%u: boot setting %s rejected\n", trace_path, trace[idx].line, trace[idx].cmd);
+            failed++;
+        }
+    }
+    mock_run_idle();
+    mock_settings_load();
+
+    if(grbl.on_spindle_select)
+        grbl.on_spindle_select(&mock_spindle);
+
+    // Further passes are not run once an expectation has failed.
+    for(pass = 0; pass < passes && !failed; pass++) {
+        if(!trace_replay())
+            return 1;
+        mock.verbose = false;
+    }
+
+    printf("%d fans, %d pass(es), %u ms simulated, %u spindle calls, %u digital and %u analog writes, %u report chars, %u warnings\n",
+            FANS_ENABLE, pass, mock.ms, mock.spindle_calls, mock.digital_writes, mock.analog_writes, mock.report_chars, mock.warnings);
+
+    for(id = 0; id < Bench_N; id++) {
+        bench_stat_t *stat = &stats[id];
+        printf("%-18s min %6llu avg %6llu max %8llu %s, %u calls\n", bench_name[id],
+                (unsigned long long)stat->min, (unsigned long long)(stat->calls ? stat->sum / stat->calls : 0),
+                 (unsigned long long)stat->max, BENCH_UNIT, stat->calls);
+    }
+
+    if(failed)
+        printf("FAILED: %u check(s)\n", failed);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Host build, FANS_ENABLE and other plugin options are set by the Makefile.
+
+#include "grbl/hal.h"
@@ -0,0 +1,247 @@
+/*
+  hal.h - minimal subset of the grblHAL core API for building the fans plugin on a host
+
+  Only the types, fields and functions referenced by fans.c are declared, values and layouts
+  does not match the real core. Implemented by mock.c.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define bit(n) (1UL << (n))
+#define bit_true(x,mask) (x) |= (mask)
+#define bit_false(x,mask) (x) &= ~(mask)
+#define bit_istrue(x,mask) ((x & (mask)) != 0)
+#define bit_isfalse(x,mask) ((x & (mask)) == 0)
+#define On 1
+#define Off 0
+#define ASCII_EOL "\r\n"
+#define N_SPINDLE 8
+#define CMD_OVERRIDE_FAN0_TOGGLE 0x8A
+#define DEFAULT_SPINDLE_RPM_MAX 1000.0f
+
+typedef uint_fast16_t sys_state_t;
+#define STATE_IDLE 0
+#define STATE_ALARM bit(0)
+#define STATE_CHECK_MODE bit(1)
+#define STATE_HOMING bit(2)
+#define STATE_CYCLE bit(3)
+#define STATE_HOLD bit(4)
+#define STATE_JOG bit(5)
+#define STATE_SAFETY_DOOR bit(6)
+#define STATE_SLEEP bit(7)
+#define STATE_ESTOP bit(8)
+#define STATE_TOOL_CHANGE bit(9)
+#define EXEC_FEED_HOLD bit(3)
+
+typedef enum {
+    Status_OK = 0,
+    Status_BadNumberFormat = 2,
+    Status_InvalidStatement = 3,
+    Status_GcodeWordRepeated = 25,
+    Status_GcodeValueWordMissing = 28,
+    Status_GcodeValueOutOfRange = 31,
+    Status_GcodeIllegalCommand = 32,
+    Status_SettingValueOutOfRange = 33,
+    Status_Unhandled = 84
+} status_code_t;
+
+typedef enum { Alarm_AbortCycle = 3, Alarm_MotorFault = 17 } alarm_code_t;
+typedef enum { Message_Info, Message_Warning } message_type_t;
+typedef enum { ProgramFlow_Running, ProgramFlow_Paused, ProgramFlow_CompletedM2 } program_flow_t;
+typedef enum { Mode_Standard = 0, Mode_Laser = 1, Mode_Lathe = 2 } machine_mode_t;
+
+typedef enum { Fan_On = 106, Fan_Off = 107 } user_mcode_t;
+typedef enum { UserMCode_Unsupported = 0, UserMCode_Normal, UserMCode_NoValueWords } user_mcode_type_t;
+
+typedef union { uint32_t mask; struct { uint32_t p:1, q:1, s:1, e:1, l:1; }; } parameter_words_t;
+typedef struct { float p, q, s, e, l; } gc_values_t;
+typedef struct {
+    user_mcode_t user_mcode;
+    bool user_mcode_sync;
+    parameter_words_t words;
+    gc_values_t values;
+} parser_block_t;
+
+typedef user_mcode_type_t (*user_mcode_check_ptr)(user_mcode_t mcode);
+typedef status_code_t (*user_mcode_validate_ptr)(parser_block_t *gc_block);
+typedef void (*user_mcode_execute_ptr)(uint_fast16_t state, parser_block_t *gc_block);
+typedef struct { user_mcode_check_ptr check; user_mcode_validate_ptr validate; user_mcode_execute_ptr execute; } user_mcode_ptrs_t;
+
+typedef union { uint8_t value; struct { uint8_t on:1, ccw:1, pwm:1, reserved:1, override_disable:1, encoder_error:1, at_speed:1, synchronized:1; }; } spindle_state_t;
+typedef union { uint8_t value; struct { uint8_t flood:1, mist:1, reserved:6; }; } coolant_state_t;
+typedef union { uint16_t value; struct { uint16_t variable:1, reversible:1, laser:1, direction:1; }; } spindle_cap_t;
+typedef int8_t spindle_id_t;
+typedef enum { SpindleType_PWM, SpindleType_Basic } spindle_type_t;
+typedef enum { SpindleSpeedMode_RPM = 0, SpindleSpeedMode_CSS } spindle_rpm_mode_t;
+
+struct spindle_ptrs;
+typedef void (*spindle_set_state_ptr)(struct spindle_ptrs *spindle, spindle_state_t state, float rpm);
+typedef void (*spindle_update_pwm_ptr)(struct spindle_ptrs *spindle, uint_fast16_t pwm);
+typedef uint_fast16_t (*spindle_get_pwm_ptr)(struct spindle_ptrs *spindle, float rpm);
+typedef struct spindle_ptrs {
+    spindle_type_t type;
+    spindle_id_t id;
+    spindle_cap_t cap;
+    float rpm_min, rpm_max;
+    spindle_get_pwm_ptr get_pwm;
+    spindle_update_pwm_ptr update_pwm;
+    spindle_set_state_ptr set_state;
+} spindle_ptrs_t;
+typedef struct { spindle_id_t id; const char *name; bool is_current; bool enabled; spindle_ptrs_t *hal; } spindle_info_t;
+typedef bool (*spindle_enumerate_callback_ptr)(spindle_info_t *spindle, void *data);
+bool spindle_enumerate_spindles (spindle_enumerate_callback_ptr callback, void *data);
+typedef void (*coolant_set_state_ptr)(coolant_state_t state);
+
+typedef union { uint32_t value; struct { uint32_t fan:1, coolant:1, spindle:1, overrides:1, all:1; }; } report_tracking_flags_t;
+typedef void (*stream_write_ptr)(const char *s);
+
+typedef enum { Port_Analog = 0, Port_Digital = 1 } io_port_type_t;
+typedef enum { Port_Input = 0, Port_Output = 1 } io_port_direction_t;
+typedef enum { WaitMode_Immediate = 0, WaitMode_Rise, WaitMode_Fall } wait_mode_t;
+typedef enum { IRQ_Mode_None = 0, IRQ_Mode_Rising = 1, IRQ_Mode_Falling = 2, IRQ_Mode_Change = 3 } pin_irq_mode_t;
+typedef union { uint32_t value; struct { uint32_t input:1, output:1, claimable:1, claimed:1, analog:1, irq_mode:4; }; } pin_mode_t;
+typedef struct { uint8_t id; pin_mode_t mode; const char *description; } xbar_t;
+typedef void (*ioport_interrupt_callback_ptr)(uint8_t port, bool state);
+
+typedef void (*foreground_task_ptr)(void *data);
+typedef struct {
+    void (*digital_out)(uint8_t port, bool on);
+    bool (*analog_out)(uint8_t port, float value);
+    int32_t (*wait_on_input)(io_port_type_t type, uint8_t port, wait_mode_t wait_mode, float timeout);
+    bool (*register_interrupt_handler)(uint8_t port, pin_irq_mode_t irq_mode, ioport_interrupt_callback_ptr interrupt_callback);
+    xbar_t *(*get_pin_info)(io_port_type_t type, io_port_direction_t dir, uint8_t port);
+    void (*set_pin_description)(io_port_type_t type, io_port_direction_t dir, uint8_t port, const char *s);
+} io_port_t;
+
+typedef uint32_t nvs_address_t;
+typedef enum { NVS_TransferResult_Failed = 0, NVS_TransferResult_Busy, NVS_TransferResult_OK } nvs_transfer_result_t;
+typedef struct {
+    nvs_transfer_result_t (*memcpy_from_nvs)(uint8_t *dest, uint32_t source, uint32_t size, bool with_checksum);
+    nvs_transfer_result_t (*memcpy_to_nvs)(uint32_t destination, uint8_t *source, uint32_t size, bool with_checksum);
+} nvs_io_t;
+
+typedef void (*driver_reset_ptr)(void);
+typedef struct { coolant_set_state_ptr set_state; coolant_state_t (*get_state)(void); } coolant_ptrs_t;
+typedef struct {
+    io_port_t port;
+    nvs_io_t nvs;
+    driver_reset_ptr driver_reset;
+    coolant_ptrs_t coolant;
+    uint32_t (*get_elapsed_ticks)(void);
+    uint32_t (*get_micros)(void);
+    uint32_t f_mcu;
+    struct { void (*write)(const char *s); } stream;
+} grbl_hal_t;
+extern grbl_hal_t hal;
+
+typedef struct { report_tracking_flags_t report; } system_t;
+extern system_t sys;
+
+typedef struct { machine_mode_t mode; uint16_t planner_buffer_blocks; } settings_t;
+extern settings_t settings;
+
+typedef bool (*on_spindle_select_ptr)(spindle_ptrs_t *spindle);
+typedef void (*on_spindle_programmed_ptr)(spindle_ptrs_t *spindle, spindle_state_t state, float rpm, spindle_rpm_mode_t mode);
+typedef void (*on_report_options_ptr)(bool newopt);
+typedef void (*on_realtime_report_ptr)(stream_write_ptr stream_write, report_tracking_flags_t report);
+typedef void (*on_program_completed_ptr)(program_flow_t program_flow, bool check_mode);
+typedef void (*on_unknown_accessory_override_ptr)(uint8_t cmd);
+typedef bool (*on_unknown_realtime_cmd_ptr)(char c);
+typedef void (*on_state_change_ptr)(sys_state_t state);
+typedef void (*on_execute_realtime_ptr)(sys_state_t state);
+typedef struct {
+    user_mcode_ptrs_t user_mcode;
+    on_spindle_select_ptr on_spindle_select;
+    on_spindle_programmed_ptr on_spindle_programmed;
+    on_report_options_ptr on_report_options;
+    on_realtime_report_ptr on_realtime_report;
+    on_program_completed_ptr on_program_completed;
+    on_unknown_accessory_override_ptr on_unknown_accessory_override;
+    on_unknown_realtime_cmd_ptr on_unknown_realtime_cmd;
+    on_state_change_ptr on_state_change;
+    on_execute_realtime_ptr on_execute_realtime;
+} grbl_t;
+extern grbl_t grbl;
+
+typedef enum { Group_Root, Group_AuxPorts, Group_Coolant, Group_Spindle, Group_General } setting_group_t;
+typedef enum { Setting_FanPort0 = 386, Setting_FanPort1, Setting_FanPort2, Setting_FanPort3, Setting_Fan0OffDelay = 480, Setting_FanToSpindleLink = 483 } setting_id_t;
+typedef enum { Format_Bool, Format_Bitfield, Format_XBitfield, Format_RadioButtons, Format_AxisMask, Format_Integer, Format_Decimal, Format_String, Format_Password, Format_IPv4, Format_Int8, Format_Int16 } setting_datatype_t;
+typedef enum { Setting_NonCore, Setting_NonCoreFn, Setting_IsExtended, Setting_IsExtendedFn } setting_type_t;
+typedef union { uint8_t value; struct { uint8_t reboot_required:1, allow_null:1, subgroups:1, increment:4, hidden:1; }; } setting_detail_flags_t;
+struct setting_detail;
+typedef bool (*setting_output_ptr)(const struct setting_detail *setting, uint_fast16_t offset);
+typedef struct setting_detail {
+    setting_id_t id;
+    setting_group_t group;
+    const char *name;
+    const char *unit;
+    setting_datatype_t datatype;
+    const char *format;
+    const char *min_value;
+    const char *max_value;
+    setting_type_t type;
+    void *value;
+    void *get_value;
+    setting_output_ptr is_available;
+    setting_detail_flags_t flags;
+} setting_detail_t;
+typedef struct { setting_id_t id; const char *description; } setting_descr_t;
+typedef union { uint32_t value; } settings_changed_flags_t;
+typedef void (*settings_changed_ptr)(settings_t *settings, settings_changed_flags_t changed);
+typedef struct setting_details {
+    const setting_detail_t *settings;
+    uint16_t n_settings;
+    const setting_descr_t *descriptions;
+    uint16_t n_descriptions;
+    settings_changed_ptr on_changed;
+    void (*save)(void);
+    void (*load)(void);
+    void (*restore)(void);
+} setting_details_t;
+void settings_register (setting_details_t *details);
+
+typedef status_code_t (*sys_command_ptr)(sys_state_t state, char *args);
+typedef union { uint8_t flags; struct { uint8_t noargs:1, allow_blocking:1, help_fn:1; }; } sys_command_flags_t;
+typedef union { const char *str; const char *(*fn)(const char *cmd); } sys_command_help_t;
+typedef struct { const char *command; sys_command_ptr execute; sys_command_flags_t flags; sys_command_help_t help; } sys_command_t;
+typedef struct sys_commands_str { const uint8_t n_commands; const sys_command_t *commands; struct sys_commands_str *next; } sys_commands_t;
+void system_register_commands (sys_commands_t *commands);
+void system_raise_alarm (alarm_code_t alarm);
+void system_set_exec_state_flag (uint_fast16_t flag);
+void system_set_exec_alarm (alarm_code_t code);
+sys_state_t state_get (void);
+
+typedef struct plan_block { struct plan_block *prev, *next; } plan_block_t;
+plan_block_t *plan_get_current_block (void);
+uint_fast16_t plan_get_block_buffer_available (void);
+
+bool task_add_delayed (foreground_task_ptr fn, void *data, uint32_t delay);
+void task_delete (foreground_task_ptr fn, void *data);
+bool task_add_immediate (foreground_task_ptr fn, void *data);
+bool task_add_systick (foreground_task_ptr fn, void *data);
+void task_delete_systick (foreground_task_ptr fn, void *data);
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data);
+void report_warning (void *message);
+void report_message (const char *msg, message_type_t type);
+void report_plugin (const char *name, const char *version);
+typedef enum { DelayMode_Dwell = 0, DelayMode_SysSuspend } delay_mode_t;
+bool delay_sec (float delay, delay_mode_t mode);
+char *uitoa (uint32_t n);
+char *ftoa (float n, uint8_t decimal_places);
+bool isintf (float value);
+bool ioport_can_claim_explicit (void);
+uint8_t ioports_available (io_port_type_t type, io_port_direction_t dir);
+bool ioport_claim (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description);
+nvs_address_t nvs_alloc (size_t size);
+
+typedef struct { void *context; uint8_t tx_length; uint8_t rx_length; bool crc_check; char adu[16]; } modbus_message_t;
+typedef struct { void (*on_rx_packet)(modbus_message_t *msg); void (*on_rx_exception)(uint8_t code, void *context); } modbus_callbacks_t;
+bool modbus_send (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block);
+bool modbus_isup (void);
+#define ModBus_WriteRegister 0x06
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "hal.h"
+
+void mc_reset (void);
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "hal.h"
+
+bool protocol_buffer_synchronize (void);
@@ -0,0 +1,572 @@
+/*
+
+  mock.c - host side mock of the grblHAL core for the fans plugin harness
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  grblHAL General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include <stdio.h>
+#include <math.h>
+
+#include "mock.h"
+
+#define N_TASKS 16
+#define NVS_SIZE 2048
+
+typedef struct {
+    foreground_task_ptr fn;
+    void *data;
+    uint32_t due;           // Tick count when due, 0 for immediate tasks
+    bool systick;
+} mock_task_t;
+
+mock_t mock = {0};
+grbl_hal_t hal = {0};
+grbl_t grbl = {0};
+system_t sys = {0};
+settings_t settings = { .mode = Mode_Standard, .planner_buffer_blocks = 35 };
+
+static sys_state_t state = STATE_IDLE;
+static mock_task_t tasks[N_TASKS];
+static setting_details_t *fan_details = NULL;
+static uint8_t nvs[NVS_SIZE];
+static uint32_t nvs_next = 1;
+static bool nvs_valid = false;
+static uint32_t claimed[2] = {0};
+static xbar_t pin;
+static const modbus_callbacks_t *modbus_callbacks = NULL;
+static modbus_message_t modbus_msg;
+
+// Driver spindle, the set_state function is wrapped by the plugin when selected.
+
+static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
+{
+    mock.spindle_calls++;
+}
+
+static uint_fast16_t spindleGetPWM (spindle_ptrs_t *spindle, float rpm)
+{
+    return (uint_fast16_t)rpm;
+}
+
+spindle_ptrs_t mock_spindle = {
+    .type = SpindleType_PWM,
+    .id = 0,
+    .cap = { .variable = On },
+    .rpm_min = 0.0f,
+    .rpm_max = 24000.0f,
+    .get_pwm = spindleGetPWM,
+    .set_state = spindleSetState
+};
+
+// HAL
+
+// Returns the output pin for a claimed or unclaimed output port number.
+static inline uint8_t outputPin (uint8_t port)
+{
+    return port >= MOCK_CLAIMED_BASE ? port - MOCK_CLAIMED_BASE : port;
+}
+
+static void digitalOut (uint8_t port, bool on)
+{
+    port = outputPin(port);
+    mock.digital_writes++;
+    if(on)
+        mock.digital |= bit(port);
+    else
+        mock.digital &= ~bit(port);
+}
+
+static bool analogOut (uint8_t port, float value)
+{
+    port = outputPin(port);
+    mock.analog_writes++;
+    if(port < MOCK_ANALOG_OUT)
+        mock.analog[port] = value;
+
+    return port < MOCK_ANALOG_OUT;
+}
+
+static int32_t waitOnInput (io_port_type_t type, uint8_t port, wait_mode_t wait_mode, float timeout)
+{
+    return type == Port_Analog ? (port < MOCK_ANALOG_IN ? mock.adc[port] : -1) : 0;
+}
+
+static bool registerInterruptHandler (uint8_t port, pin_irq_mode_t irq_mode, ioport_interrupt_callback_ptr interrupt_callback)
+{
+    return port < MOCK_DIGITAL_IN;
+}
+
+static xbar_t *getPinInfo (io_port_type_t type, io_port_direction_t dir, uint8_t port)
+{
+    if(dir != Port_Output || port >= (type == Port_Analog ? MOCK_ANALOG_OUT : MOCK_DIGITAL_OUT))
+        return NULL;
+
+    pin.id = port;
+    pin.mode.value = 0;
+    pin.mode.output = On;
+    pin.mode.analog = type == Port_Analog;
+    pin.mode.claimable = On;
+    pin.mode.claimed = !!(claimed[type == Port_Analog] & bit(port));
+    pin.description = NULL;
+
+    return &pin;
+}
+
+static void setPinDescription (io_port_type_t type, io_port_direction_t dir, uint8_t port, const char *s)
+{
+}
+
+static nvs_transfer_result_t memcpyFromNVS (uint8_t *dest, uint32_t source, uint32_t size, bool with_checksum)
+{
+    if(!nvs_valid || source + size > NVS_SIZE)
+        return NVS_TransferResult_Failed;
+
+    memcpy(dest, &nvs[source], size);
+
+    return NVS_TransferResult_OK;
+}
+
+static nvs_transfer_result_t memcpyToNVS (uint32_t destination, uint8_t *source, uint32_t size, bool with_checksum)
+{
+    if(destination + size > NVS_SIZE)
+        return NVS_TransferResult_Failed;
+
+    memcpy(&nvs[destination], source, size);
+    nvs_valid = true;
+
+    return NVS_TransferResult_OK;
+}
+
+static uint32_t getElapsedTicks (void)
+{
+    return mock.ms;
+}
+
+static uint32_t getMicros (void)
+{
+    return mock.ms * 1000;
+}
+
+static void streamWrite (const char *s)
+{
+    if(mock.verbose)
+        fputs(s, stdout);
+}
+
+void mock_report_write (const char *s)
+{
+    mock.report_chars += strlen(s);
+    if(mock.verbose)
+        fputs(s, stdout);
+}
+
+// Core handlers that plugins chain to without checking, as set up by the core.
+
+static void executeRealtime (sys_state_t state)
+{
+}
+
+static void reportOptions (bool newopt)
+{
+}
+
+static void driverReset (void)
+{
+}
+
+static void coolantSetState (coolant_state_t state)
+{
+}
+
+void mock_init (void)
+{
+    grbl.on_execute_realtime = executeRealtime;
+    grbl.on_report_options = reportOptions;
+    hal.driver_reset = driverReset;
+    hal.coolant.set_state = coolantSetState;
+    hal.port.digital_out = digitalOut;
+    hal.port.analog_out = analogOut;
+    hal.port.wait_on_input = waitOnInput;
+    hal.port.register_interrupt_handler = registerInterruptHandler;
+    hal.port.get_pin_info = getPinInfo;
+    hal.port.set_pin_description = setPinDescription;
+    hal.nvs.memcpy_from_nvs = memcpyFromNVS;
+    hal.nvs.memcpy_to_nvs = memcpyToNVS;
+    hal.get_elapsed_ticks = getElapsedTicks;
+    hal.get_micros = getMicros;
+    hal.stream.write = streamWrite;
+    hal.f_mcu = 100;
+
+    mock.ms = 1;
+    mock.adc[0] = mock.adc[1] = 2048;
+}
+
+// Tasks, delayed tasks are run when mock time passes their deadline.
+
+static bool task_add (foreground_task_ptr fn, void *data, uint32_t due, bool systick)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_TASKS; idx++) {
+        if(tasks[idx].fn == NULL) {
+            tasks[idx].fn = fn;
+            tasks[idx].data = data;
+            tasks[idx].due = due;
+            tasks[idx].systick = systick;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void tasks_remove (foreground_task_ptr fn, void *data, bool systick)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_TASKS; idx++) {
+        if(tasks[idx].fn == fn && tasks[idx].data == data && tasks[idx].systick == systick)
+            tasks[idx].fn = NULL;
+    }
+}
+
+bool task_add_delayed (foreground_task_ptr fn, void *data, uint32_t delay)
+{
+    return task_add(fn, data, mock.ms + delay, false);
+}
+
+void task_delete (foreground_task_ptr fn, void *data)
+{
+    tasks_remove(fn, data, false);
+}
+
+bool task_add_immediate (foreground_task_ptr fn, void *data)
+{
+    return task_add(fn, data, 0, false);
+}
+
+bool task_add_systick (foreground_task_ptr fn, void *data)
+{
+    return task_add(fn, data, 0, true);
+}
+
+void task_delete_systick (foreground_task_ptr fn, void *data)
+{
+    tasks_remove(fn, data, true);
+}
+
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data)
+{
+    return task_add_immediate(fn, data);
+}
+
+// Runs due tasks and the realtime handler for the current tick.
+static void mock_tick (void)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_TASKS; idx++) {
+        mock_task_t task = tasks[idx];
+        if(task.fn && (task.systick || task.due <= mock.ms)) {
+            if(!task.systick)
+                tasks[idx].fn = NULL;
+            task.fn(task.data);
+        }
+    }
+
+    grbl.on_execute_realtime(state);
+}
+
+// Advances mock time by ms milliseconds.
+void mock_run (uint32_t ms)
+{
+    mock_tick();
+
+    while(ms--) {
+        mock.ms++;
+        mock_tick();
+    }
+}
+
+// Advances mock time until no tasks are pending, at most 60 seconds.
+void mock_run_idle (void)
+{
+    uint_fast8_t idx;
+    uint32_t ms = 60000;
+    bool pending;
+
+    do {
+        mock_run(1);
+        for(idx = 0, pending = false; idx < N_TASKS; idx++)
+            pending = pending || (tasks[idx].fn && !tasks[idx].systick);
+    } while(pending && --ms);
+}
+
+void mock_set_state (sys_state_t new_state)
+{
+    if(new_state != state) {
+        state = new_state;
+        if(grbl.on_state_change)
+            grbl.on_state_change(state);
+    }
+}
+
+sys_state_t state_get (void)
+{
+    return state;
+}
+
+bool delay_sec (float delay, delay_mode_t mode)
+{
+    mock_run((uint32_t)ceilf(delay * 1000.0f));
+
+    return true;
+}
+
+bool protocol_buffer_synchronize (void)
+{
+    return true;
+}
+
+void mc_reset (void)
+{
+    mock.warnings++;
+}
+
+void system_raise_alarm (alarm_code_t alarm)
+{
+    mock.warnings++;
+}
+
+void system_set_exec_alarm (alarm_code_t code)
+{
+    mock.warnings++;
+}
+
+void system_set_exec_state_flag (uint_fast16_t flag)
+{
+}
+
+plan_block_t *plan_get_current_block (void)
+{
+    return NULL;
+}
+
+uint_fast16_t plan_get_block_buffer_available (void)
+{
+    return settings.planner_buffer_blocks - 1;
+}
+
+// Settings, only the plugin settings are handled.
+
+void settings_register (setting_details_t *details)
+{
+    fan_details = details;
+}
+
+void mock_settings_restore (void)
+{
+    if(fan_details && fan_details->restore)
+        fan_details->restore();
+}
+
+void mock_settings_load (void)
+{
+    if(fan_details && fan_details->load)
+        fan_details->load();
+}
+
+// Sets a plugin setting as the $<id>=<value> command does. The settings changed handler is not called
+// for boot settings, these are set after restoring defaults and before the settings are loaded.
+status_code_t mock_setting_set (setting_id_t id, float value, bool boot)
+{
+    uint_fast16_t idx;
+    status_code_t status = Status_Unhandled;
+
+    for(idx = 0; fan_details && idx < fan_details->n_settings; idx++) {
+
+        const setting_detail_t *setting = &fan_details->settings[idx];
+
+        if(setting->id != id)
+            continue;
+
+        if(setting->type == Setting_NonCoreFn || setting->type == Setting_IsExtendedFn) {
+            if(setting->datatype == Format_Decimal)
+                status = ((status_code_t (*)(setting_id_t, float))setting->value)(id, value);
+            else
+                status = ((status_code_t (*)(setting_id_t, uint32_t))setting->value)(id, (uint32_t)value);
+        } else {
+            status = Status_OK;
+            switch(setting->datatype) {
+
+                case Format_Decimal:
+                    *(float *)setting->value = value;
+                    break;
+
+                case Format_Int16:
+                    *(uint16_t *)setting->value = (uint16_t)value;
+                    break;
+
+                case Format_Integer:
+                    *(uint32_t *)setting->value = (uint32_t)value;
+                    break;
+
+                default:
+                    *(uint8_t *)setting->value = (uint8_t)value;
+                    break;
+            }
+        }
+
+        if(status == Status_OK) {
+            if(fan_details->save)
+                fan_details->save();
+            if(fan_details->on_changed && !boot)
+                fan_details->on_changed(&settings, (settings_changed_flags_t){0});
+        }
+        break;
+    }
+
+    return status;
+}
+
+void system_register_commands (sys_commands_t *commands)
+{
+}
+
+bool spindle_enumerate_spindles (spindle_enumerate_callback_ptr callback, void *data)
+{
+    spindle_info_t spindle = {
+        .id = mock_spindle.id,
+        .name = "Mock",
+        .is_current = true,
+        .enabled = true,
+        .hal = &mock_spindle
+    };
+
+    return callback(&spindle, data);
+}
+
+// Ports
+
+bool ioport_can_claim_explicit (void)
+{
+    return true;
+}
+
+uint8_t ioports_available (io_port_type_t type, io_port_direction_t dir)
+{
+    if(dir == Port_Output)
+        return type == Port_Analog ? MOCK_ANALOG_OUT : MOCK_DIGITAL_OUT;
+
+    return type == Port_Analog ? MOCK_ANALOG_IN : MOCK_DIGITAL_IN;
+}
+
+bool ioport_claim (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description)
+{
+    uint_fast8_t analog = type == Port_Analog;
+
+    if(*port >= ioports_available(type, dir))
+        return false;
+
+    if(dir == Port_Output) {
+        if(claimed[analog] & bit(*port))
+            return false;
+        claimed[analog] |= bit(*port);
+        *port += MOCK_CLAIMED_BASE;
+    }
+
+    return true;
+}
+
+nvs_address_t nvs_alloc (size_t size)
+{
+    nvs_address_t addr = nvs_next;
+
+    if(nvs_next + size > NVS_SIZE)
+        return 0;
+
+    nvs_next += size;
+
+    return addr;
+}
+
+// Modbus, messages are answered immediately from within modbus_send() and written register values are recorded.
+
+bool modbus_isup (void)
+{
+    return true;
+}
+
+bool modbus_send (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block)
+{
+    modbus_callbacks = callbacks;
+    memcpy(&modbus_msg, msg, sizeof(modbus_message_t));
+
+    if(msg->adu[1] == ModBus_WriteRegister) {
+        mock.modbus_writes++;
+        mock.modbus[(uint8_t)msg->adu[0] % MOCK_MODBUS_SLAVES] = ((uint8_t)msg->adu[4] << 8) | (uint8_t)msg->adu[5];
+    }
+
+    if(modbus_callbacks && modbus_callbacks->on_rx_packet)
+        modbus_callbacks->on_rx_packet(&modbus_msg);
+
+    return true;
+}
+
+// Reports and formatting
+
+void report_warning (void *message)
+{
+    mock.warnings++;
+    if(mock.verbose)
+        printf("[MSG:Warning: %s]\n", (char *)message);
+}
+
+void report_message (const char *msg, message_type_t type)
+{
+    if(type == Message_Warning)
+        mock.warnings++;
+    if(mock.verbose)
+        printf("[MSG:%s]\n", msg);
+}
+
+void report_plugin (const char *name, const char *version)
+{
+}
+
+char *uitoa (uint32_t n)
+{
+    static char buf[12];
+
+    snprintf(buf, sizeof(buf), "%u", (unsigned)n);
+
+    return buf;
+}
+
+char *ftoa (float n, uint8_t decimal_places)
+{
+    static char buf[24];
+
+    snprintf(buf, sizeof(buf), "%.*f", decimal_places, (double)n);
+
+    return buf;
+}
+
+bool isintf (float value)
+{
+    return !isnan(value) && fabsf(value - truncf(value)) < 0.001f;
+}
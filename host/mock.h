@@ -0,0 +1,58 @@
+/*
+
+  mock.h - host side mock of the grblHAL core for the fans plugin harness
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  grblHAL General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include "grbl/hal.h"
+
+#define MOCK_DIGITAL_OUT 8
+#define MOCK_ANALOG_OUT  4
+#define MOCK_DIGITAL_IN  8
+#define MOCK_ANALOG_IN   2
+#define MOCK_MODBUS_SLAVES 248
+#define MOCK_CLAIMED_BASE 16            // Claimed output ports are renumbered from here, as done by some drivers
+
+typedef struct {
+    uint32_t ms;                        // Mock time, returned by hal.get_elapsed_ticks()
+    uint32_t digital;                   // Digital output states, bit per port
+    float analog[MOCK_ANALOG_OUT];      // Analog output values
+    int32_t adc[MOCK_ANALOG_IN];        // Analog input readings, 12 bit
+    uint32_t digital_writes;            // Number of hal.port.digital_out() calls
+    uint32_t analog_writes;             // Number of hal.port.analog_out() calls
+    uint16_t modbus[MOCK_MODBUS_SLAVES]; // Last register value written, per Modbus slave address
+    uint32_t modbus_writes;             // Number of Modbus write register commands sent
+    uint32_t spindle_calls;             // Number of calls to the spindle set_state function wrapped by the plugin
+    uint32_t report_chars;              // Characters written by the realtime report handler
+    uint32_t warnings;                  // Warnings and alarms raised by the plugin
+    bool verbose;                       // Echo stream output and messages to stdout
+} mock_t;
+
+extern mock_t mock;
+extern spindle_ptrs_t mock_spindle;
+
+void mock_init (void);
+void mock_run (uint32_t ms);
+void mock_run_idle (void);
+void mock_set_state (sys_state_t state);
+void mock_settings_restore (void);
+void mock_settings_load (void);
+status_code_t mock_setting_set (setting_id_t id, float value, bool boot);
+void mock_report_write (const char *s);